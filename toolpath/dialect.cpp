@@ -0,0 +1,365 @@
+/*
+ * (C) Copyright 2019  -  Arjan van de Ven <arjanvandeven@gmail.com>
+ *
+ * This file is part of FenrusCNCtools
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <vector>
+
+#include "dialect.h"
+
+/*
+ * grbl only has an 80 byte line buffer (and a 127 byte serial buffer in front
+ * of it); the shorter the blocks, the more of them fit in the serial buffer
+ * and the less the planner starves on dense paths. Carbide Motion is grbl
+ * underneath but does the tool change prompt itself.
+ */
+static const struct gcode_dialect dialects[] = {
+	/* name		xy	z	compress percent comments manual_tc max_block */
+	{"generic",	-1,	-1,	false,	true,	true,	false,	0},
+	{"grbl",	3,	3,	true,	false,	false,	true,	80},
+	{"linuxcnc",	4,	4,	true,	true,	true,	false,	256},
+	{"carbide",	3,	3,	true,	false,	true,	false,	80},
+};
+
+const struct gcode_dialect *find_dialect(const char *name)
+{
+	for (auto &d : dialects)
+		if (strcasecmp(d.name, name) == 0)
+			return &d;
+	return NULL;
+}
+
+postprocessor::postprocessor(const struct gcode_dialect *_dialect, bool _line_numbers)
+{
+	dialect = _dialect;
+	line_numbers = _line_numbers;
+	reset();
+}
+
+/* a new file: the controller starts without any modal state */
+void postprocessor::reset(void)
+{
+	line_number = 1;
+	partial.clear();
+	motion = -1;
+	last_X.clear();
+	last_Y.clear();
+	last_Z.clear();
+	last_F.clear();
+}
+
+/* round to <decimals> places and drop every character that carries no information */
+std::string postprocessor::format_number(const std::string &value, int decimals)
+{
+	char tmp[32];
+	long long scale, v, ip, fp;
+	std::string s;
+	int n;
+
+	if (decimals < 0)
+		return value;
+
+	scale = (long long)pow(10, decimals);
+	v = llround(strtod(value.c_str(), NULL) * scale);
+	if (v < 0) {
+		s += '-';
+		v = -v;
+	}
+	ip = v / scale;
+	fp = v % scale;
+	if (ip || !fp) {
+		snprintf(tmp, sizeof(tmp), "%lli", ip);
+		s += tmp;
+	}
+	if (fp) {
+		n = snprintf(tmp, sizeof(tmp), "%0*lli", decimals, fp);
+		while (n > 0 && tmp[n - 1] == '0')
+			tmp[--n] = 0;
+		s += '.';
+		s += tmp;
+	}
+	if (s == "-0")
+		s = "0";
+	return s;
+}
+
+void postprocessor::emit(std::string &block, std::string &out)
+{
+	if (line_numbers) {
+		char tmp[16];
+		snprintf(tmp, sizeof(tmp), dialect->compress ? "N%i" : "N%i ", line_number);
+		block.insert(0, tmp);
+		/* rs274ngc does not take line numbers beyond 99999 */
+		if (++line_number > 99999)
+			line_number = 1;
+	}
+	/* a trailing comment is the only part of a block that can go */
+	if (dialect->max_block && block.size() + 1 > dialect->max_block) {
+		size_t c = block.find('(');
+		if (c != std::string::npos)
+			block.resize(c);
+		while (block.size() > 0 && block.back() == ' ')
+			block.pop_back();
+	}
+	if (dialect->max_block && block.size() + 1 > dialect->max_block)
+		printf("Error: gcode block is longer than the %u bytes %s accepts: %s\n", dialect->max_block, dialect->name, block.c_str());
+	out += block;
+	out += '\n';
+}
+
+struct gword {
+	char letter;
+	std::string value;
+};
+
+void postprocessor::process_line(const char *line, unsigned int len, std::string &out)
+{
+	std::vector<struct gword> words;
+	std::string block, comment, X, Y, Z, F;
+	int new_motion = motion;
+	bool had_axis = false, other = false, stop = false;
+	unsigned int i = 0;
+
+	if (len > 0 && line[len - 1] == '\r')
+		len--;
+	if (len == 0)
+		return;
+
+	if (line[0] == '%') {
+		if (dialect->keep_percent)
+			out += "%\n";
+		return;
+	}
+
+	if (line[0] == '(') {
+		if (!dialect->keep_comments)
+			return;
+		block.assign(line, len);
+		if (dialect->max_block && block.size() + 1 > dialect->max_block) {
+			block.resize(dialect->max_block - 2);
+			block += ')';
+		}
+		out += block;
+		out += '\n';
+		return;
+	}
+
+	if (!dialect->compress) {
+		block.assign(line, len);
+		emit(block, out);
+		return;
+	}
+
+	while (i < len) {
+		struct gword w;
+
+		if (isspace(line[i])) {
+			i++;
+			continue;
+		}
+		if (line[i] == '(') {
+			if (dialect->keep_comments)
+				comment.assign(line + i, len - i);
+			break;
+		}
+		w.letter = toupper(line[i++]);
+		while (i < len && (isdigit(line[i]) || line[i] == '.' || line[i] == '-' || line[i] == '+'))
+			w.value += line[i++];
+		words.push_back(w);
+	}
+
+	for (auto &w : words) {
+		switch (w.letter) {
+			case 'G':
+				if (w.value == "0" || w.value == "1" || w.value == "2" || w.value == "3")
+					new_motion = atoi(w.value.c_str());
+				else
+					other = true;
+				break;
+			case 'X':
+				X = format_number(w.value, dialect->decimals_xy);
+				had_axis = true;
+				break;
+			case 'Y':
+				Y = format_number(w.value, dialect->decimals_xy);
+				had_axis = true;
+				break;
+			case 'Z':
+				Z = format_number(w.value, dialect->decimals_z);
+				had_axis = true;
+				break;
+			case 'I':
+			case 'J':
+				w.value = format_number(w.value, dialect->decimals_xy);
+				break;
+			case 'F':
+				F = w.value;
+				break;
+			case 'M':
+				if (w.value == "0" || w.value == "1" || w.value == "2" || w.value == "6" || w.value == "30")
+					stop = true;
+				other = true;
+				break;
+			default:
+				other = true;
+		}
+	}
+
+	/* the controller is already there on these axes */
+	if (X == last_X)
+		X.clear();
+	if (Y == last_Y)
+		Y.clear();
+	if (Z == last_Z)
+		Z.clear();
+	if (F == last_F)
+		F.clear();
+
+	/* an arc whose end rounds onto its start would become a full circle */
+	if ((new_motion == 2 || new_motion == 3) && X.empty() && Y.empty())
+		new_motion = 1;
+
+	/* a move that rounds to nothing; the writer won't repeat its feed though */
+	if (had_axis && X.empty() && Y.empty() && Z.empty() && !other) {
+		if (!F.empty()) {
+			last_F = F;
+			block = 'F' + F;
+			emit(block, out);
+		}
+		return;
+	}
+
+	for (auto &w : words) {
+		switch (w.letter) {
+			case 'G':
+				if (w.value == "0" || w.value == "1" || w.value == "2" || w.value == "3") {
+					if (new_motion != motion || !had_axis)
+						block += 'G' + std::to_string(new_motion);
+				} else {
+					block += 'G' + w.value;
+				}
+				break;
+			case 'X':
+				if (!X.empty())
+					block += 'X' + X;
+				break;
+			case 'Y':
+				if (!Y.empty())
+					block += 'Y' + Y;
+				break;
+			case 'Z':
+				if (!Z.empty())
+					block += 'Z' + Z;
+				break;
+			case 'I':
+			case 'J':
+				if (new_motion == 2 || new_motion == 3)
+					block += w.letter + w.value;
+				break;
+			case 'F':
+				if (!F.empty())
+					block += 'F' + F;
+				break;
+			case 'M':
+				if (w.value == "6" && dialect->manual_tool_change) {
+					for (auto &t : words)
+						if (t.letter == 'T')
+							out += "(MSG,Change to tool T" + t.value + ")\n";
+					block += "M0";
+				} else {
+					block += 'M' + w.value;
+				}
+				break;
+			case 'T':
+				if (!dialect->manual_tool_change)
+					block += 'T' + w.value;
+				break;
+			default:
+				block += w.letter + w.value;
+		}
+	}
+	block += comment;
+
+	motion = new_motion;
+	if (!X.empty())
+		last_X = X;
+	if (!Y.empty())
+		last_Y = Y;
+	if (!Z.empty())
+		last_Z = Z;
+	if (!F.empty())
+		last_F = F;
+
+	/*
+	 * The operator may jog and re-zero during a pause or a tool change, and
+	 * a new program starts from scratch: restate every axis and the motion
+	 * mode after one, or the retract that follows gets dropped as a repeat.
+	 */
+	if (stop) {
+		motion = -1;
+		last_X.clear();
+		last_Y.clear();
+		last_Z.clear();
+		last_F.clear();
+	}
+
+	if (block.empty())
+		return;
+	emit(block, out);
+}
+
+/* rewrite a chunk of the generic output; lines may be split across chunks */
+void postprocessor::process(const char *in, unsigned int len, std::string &out)
+{
+	unsigned int start = 0, i;
+
+	for (i = 0; i < len; i++) {
+		if (in[i] != '\n')
+			continue;
+		if (!partial.empty()) {
+			partial.append(in + start, i - start);
+			process_line(partial.data(), partial.size(), out);
+			partial.clear();
+		} else {
+			process_line(in + start, i - start, out);
+		}
+		start = i + 1;
+	}
+	partial.append(in + start, len - start);
+}
+
+/*
+ * Comment lines that have to make it into the file whatever the dialect does
+ * with the comments of the generic output, like the cycle time estimate.
+ * They get a line number like any other block, and are cut to fit.
+ */
+void postprocessor::process_notes(const char *in, unsigned int len, std::string &out)
+{
+	unsigned int start = 0, i, room = 0;
+	std::string block;
+
+	/* what is left once emit() put the line number in front */
+	if (dialect->max_block)
+		room = dialect->max_block - 1 - (line_numbers ? strlen("N99999 ") : 0);
+
+	for (i = 0; i < len; i++) {
+		if (in[i] != '\n')
+			continue;
+		block.assign(in + start, i - start);
+		start = i + 1;
+		if (block.empty())
+			continue;
+		if (room && block.size() > room) {
+			block.resize(room - 1);
+			block += ')';
+		}
+		emit(block, out);
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <string>
+
+/*
+ * What a particular controller accepts and prefers. The writer always
+ * produces the same generic G-code; a postprocessor rewrites it line by line
+ * for the selected dialect.
+ */
+struct gcode_dialect {
+	const char *name;
+	int decimals_xy;		/* for X Y I J; -1 leaves the numbers alone */
+	int decimals_z;			/* for Z; -1 leaves the numbers alone */
+	bool compress;			/* drop modal words, spaces and leading/trailing zeros */
+	bool keep_percent;		/* % program delimiters */
+	bool keep_comments;
+	bool manual_tool_change;	/* no M6: ask for the tool and pause with M0 */
+	unsigned int max_block;		/* longest block the controller takes, including the newline */
+};
+
+extern const struct gcode_dialect *find_dialect(const char *name);
+
+class postprocessor {
+public:
+	postprocessor(const struct gcode_dialect *_dialect, bool _line_numbers);
+
+	void reset(void);
+	void process(const char *in, unsigned int len, std::string &out);
+	void process_notes(const char *in, unsigned int len, std::string &out);
+
+private:
+	const struct gcode_dialect *dialect;
+	bool line_numbers;
+	int line_number;
+
+	/* a line that was split over two flushes */
+	std::string partial;
+
+	/* modal state of the controller, as last written */
+	int motion;
+	std::string last_X, last_Y, last_Z, last_F;
+
+	void process_line(const char *line, unsigned int len, std::string &out);
+	void emit(std::string &block, std::string &out);
+	std::string format_number(const std::string &value, int decimals);
+};
@@ -0,0 +1,277 @@
+/*
+ * (C) Copyright 2019  -  Arjan van de Ven <arjanvandeven@gmail.com>
+ *
+ * This file is part of FenrusCNCtools
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "estimate.h"
+
+estimator::estimator(double _accel, double _junction_deviation, double _rapid)
+{
+	accel = _accel;
+	junction_deviation = _junction_deviation;
+	rapid = _rapid;
+	reset();
+}
+
+void estimator::reset(void)
+{
+	partial.clear();
+	queue.clear();
+	entry_speed = 0;
+	last_nominal = 0;
+	motion = 0;
+	X = Y = Z = F = 0;
+	dirX = dirY = dirZ = 0;
+	have_dir = false;
+	cut_time = air_time = rapid_time = 0;
+	tools.clear();
+}
+
+/* time to cover <L> going from <v0> to <v1>, cruising at <vc> if there's room */
+static double trapezoid(double L, double v0, double v1, double vc, double a)
+{
+	double da = (vc * vc - v0 * v0) / (2 * a);
+	double dd = (vc * vc - v1 * v1) / (2 * a);
+	double vp;
+
+	if (da + dd <= L)
+		return (vc - v0) / a + (vc - v1) / a + (L - da - dd) / vc;
+
+	vp = sqrt((2 * a * L + v0 * v0 + v1 * v1) / 2);
+	vp = fmax(vp, fmax(v0, v1));
+	return (vp - v0) / a + (vp - v1) / a;
+}
+
+/*
+ * Plan the lookahead window the way the controller does (everything after the
+ * window might be a stop) and execute its first block.
+ */
+void estimator::retire(void)
+{
+	struct eblock *b = &queue[0];
+	double v = 0, t;
+	unsigned int i;
+
+	for (i = queue.size() - 1; i >= 1; i--)
+		v = fmin(queue[i].max_entry, sqrt(v * v + 2 * accel * queue[i].length));
+	v = fmin(v, sqrt(entry_speed * entry_speed + 2 * accel * b->length));
+
+	t = trapezoid(b->length, entry_speed, v, b->nominal, accel);
+	if (b->rapid) {
+		rapid_time += t;
+	} else {
+		air_time += t * b->air;
+		cut_time += t * (1 - b->air);
+	}
+	/* before the first tool change */
+	if (tools.size() == 0)
+		tools.push_back({-1, 0});
+	tools.back().seconds += t;
+
+	entry_speed = v;
+	queue.erase(queue.begin());
+}
+
+/* the controller drains its buffer, e.g. for a spindle or tool change */
+void estimator::stop(void)
+{
+	while (queue.size() > 0)
+		retire();
+	entry_speed = 0;
+	have_dir = false;
+}
+
+void estimator::add_block(double length, double nominal, double inX, double inY, double inZ, double outX, double outY, double outZ, double air, bool is_rapid)
+{
+	struct eblock b;
+
+	if (length < 0.000001)
+		return;
+
+	b.length = length;
+	b.nominal = nominal;
+	b.air = air;
+	b.rapid = is_rapid;
+	b.max_entry = 0;
+
+	/* junction deviation: the speed at which a circle of that deviation, tangent to both moves, is within the acceleration */
+	if (have_dir) {
+		double cos_theta = -(dirX * inX + dirY * inY + dirZ * inZ);
+
+		if (cos_theta < -0.999999) {
+			b.max_entry = nominal;
+		} else if (cos_theta < 0.999999) {
+			double sin_theta_d2 = sqrt(0.5 * (1 - cos_theta));
+			b.max_entry = sqrt(accel * junction_deviation * sin_theta_d2 / (1 - sin_theta_d2));
+		}
+		b.max_entry = fmin(b.max_entry, fmin(nominal, last_nominal));
+	}
+
+	queue.push_back(b);
+	dirX = outX;
+	dirY = outY;
+	dirZ = outZ;
+	have_dir = true;
+	last_nominal = nominal;
+
+	if (queue.size() > ESTIMATE_LOOKAHEAD)
+		retire();
+}
+
+/* the part of a straight (or helical) move from Z0 to Z1 that is above the stock */
+static double air_fraction(double Z0, double Z1)
+{
+	if (Z0 >= 0 && Z1 >= 0)
+		return 1;
+	if (Z0 < 0 && Z1 < 0)
+		return 0;
+	return fmax(Z0, Z1) / fabs(Z1 - Z0);
+}
+
+void estimator::process_line(const char *line, unsigned int len)
+{
+	double nX = X, nY = Y, nZ = Z, I = 0, J = 0;
+	bool has_axis = false;
+	int toolnr = -1;
+	bool sync = false;
+	unsigned int i = 0;
+
+	if (len == 0 || line[0] == '%' || line[0] == '(')
+		return;
+
+	while (i < len) {
+		char letter, *end;
+		double value;
+
+		if (line[i] == '(')
+			break;
+		if (!isalpha(line[i])) {
+			i++;
+			continue;
+		}
+		letter = toupper(line[i++]);
+		value = strtod(line + i, &end);
+		if (end == line + i)
+			continue;
+		i = end - line;
+
+		switch (letter) {
+			case 'G':
+				if (value == 0 || value == 1 || value == 2 || value == 3)
+					motion = (int)value;
+				break;
+			case 'X': nX = value; has_axis = true; break;
+			case 'Y': nY = value; has_axis = true; break;
+			case 'Z': nZ = value; has_axis = true; break;
+			case 'I': I = value; break;
+			case 'J': J = value; break;
+			case 'F': F = value; break;
+			case 'T': toolnr = (int)value; break;
+			case 'M': sync = true; break;
+		}
+	}
+
+	if (sync)
+		stop();
+	if (toolnr >= 0)
+		tools.push_back({toolnr, 0});
+
+	if (!has_axis)
+		return;
+
+	double feed = F > 0 ? F / 60 : rapid;
+
+	if (motion == 2 || motion == 3) {
+		double cx = X + I, cy = Y + J;
+		double r = sqrt(I * I + J * J);
+		double a0 = atan2(Y - cy, X - cx);
+		double a1 = atan2(nY - cy, nX - cx);
+		double sweep, length, dir = motion == 3 ? 1 : -1;
+
+		sweep = dir * (a1 - a0);
+		if (sweep <= 0)
+			sweep += 2 * M_PI;
+		length = sqrt((r * sweep) * (r * sweep) + (nZ - Z) * (nZ - Z));
+
+		if (r > 0.000001)
+			/* grbl cuts the arc into chords; the corners between those limit the speed like a centripetal acceleration would */
+			add_block(length, fmin(feed, sqrt(accel * r)),
+				-dir * (Y - cy) / r, dir * (X - cx) / r, 0,
+				-dir * (nY - cy) / r, dir * (nX - cx) / r, 0,
+				air_fraction(Z, nZ), false);
+	} else {
+		double dX = nX - X, dY = nY - Y, dZ = nZ - Z;
+		double length = sqrt(dX * dX + dY * dY + dZ * dZ);
+
+		if (length > 0.000001)
+			add_block(length, motion == 0 ? rapid : feed,
+				dX / length, dY / length, dZ / length,
+				dX / length, dY / length, dZ / length,
+				air_fraction(Z, nZ), motion == 0);
+	}
+	X = nX;
+	Y = nY;
+	Z = nZ;
+}
+
+/* feed a chunk of (generic) gcode text; lines may be split across chunks */
+void estimator::process(const char *in, unsigned int len)
+{
+	unsigned int start = 0, i;
+
+	for (i = 0; i < len; i++) {
+		if (in[i] != '\n')
+			continue;
+		if (!partial.empty()) {
+			partial.append(in + start, i - start);
+			process_line(partial.data(), partial.size());
+			partial.clear();
+		} else {
+			process_line(in + start, i - start);
+		}
+		start = i + 1;
+	}
+	partial.append(in + start, len - start);
+}
+
+void estimator::finish(void)
+{
+	stop();
+}
+
+static void format_time(char *buf, unsigned int size, double seconds)
+{
+	int s = (int)(seconds + 0.5);
+
+	snprintf(buf, size, "%i:%02i:%02i", s / 3600, (s / 60) % 60, s % 60);
+}
+
+/* the breakdown as G-code comments */
+void estimator::report(std::string &out)
+{
+	char line[256], t1[32], t2[32], t3[32], t4[32];
+
+	format_time(t1, sizeof(t1), total());
+	format_time(t2, sizeof(t2), cut_time);
+	format_time(t3, sizeof(t3), air_time);
+	format_time(t4, sizeof(t4), rapid_time);
+	snprintf(line, sizeof(line), "(Estimated cycle time %s)\n(Cutting %s, air cutting %s, rapids %s)\n", t1, t2, t3, t4);
+	out += line;
+	for (auto &t : tools) {
+		if (t.seconds <= 0 || t.toolnr < 0)
+			continue;
+		format_time(t1, sizeof(t1), t.seconds);
+		snprintf(line, sizeof(line), "(Tool T%i %s)\n", t.toolnr, t1);
+		out += line;
+	}
+	snprintf(line, sizeof(line), "(Acceleration %.0f mm/s^2, junction deviation %.3f mm, rapids %.0f mm/min)\n", accel, junction_deviation, rapid * 60);
+	out += line;
+}
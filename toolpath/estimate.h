@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/*
+ * Cycle time estimate for the G-code as it is written, using the same kind of
+ * model a grbl style planner uses: trapezoidal speed profiles with a single
+ * acceleration, and junction deviation to limit the speed through corners.
+ * Like the controller, it only looks ahead a limited number of blocks.
+ */
+#define ESTIMATE_LOOKAHEAD 64
+
+struct eblock {
+	double length;
+	double nominal;		/* mm/s */
+	double max_entry;	/* mm/s, from the junction with the previous block */
+	double air;		/* fraction of the length above the stock */
+	bool rapid;
+};
+
+struct etool {
+	int toolnr;
+	double seconds;
+};
+
+class estimator {
+public:
+	estimator(double _accel, double _junction_deviation, double _rapid);
+
+	void reset(void);
+	void process(const char *in, unsigned int len);
+	void finish(void);
+	void report(std::string &out);
+	double total(void) { return cut_time + air_time + rapid_time; };
+
+private:
+	double accel;			/* mm/s^2 */
+	double junction_deviation;	/* mm */
+	double rapid;			/* mm/s */
+
+	std::string partial;
+	std::vector<struct eblock> queue;
+	double entry_speed;		/* of queue[0] */
+	double last_nominal;
+
+	/* modal state and position of the controller */
+	int motion;
+	double X, Y, Z, F;
+	double dirX, dirY, dirZ;	/* direction at the end of the last block */
+	bool have_dir;
+
+	double cut_time, air_time, rapid_time;
+	std::vector<struct etool> tools;
+
+	void process_line(const char *line, unsigned int len);
+	void add_block(double length, double nominal, double inX, double inY, double inZ, double outX, double outY, double outZ, double air, bool is_rapid);
+	void retire(void);
+	void stop(void);
+};
@@ -46,5 +46,7 @@ extern double scale_Z(void);
 extern double get_height(double X, double Y);
 extern void reset_triangles(void);
 extern struct line * stl_vertical_triangles(double radius);
+extern void set_heightmap_resolution(double resolution);
+extern void build_heightmap(void);
 
 #endif
\ No newline at end of file
@@ -7,23 +7,53 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <math.h>
+#include <string>
 #include <vector>
+#include <unordered_map>
 
 extern "C" {
 #include "toolpath.h"
 }
 
 #include "gcode.h"
+#include "endmill.h"
+#include "dialect.h"
+#include "estimate.h"
 
+/* settings that apply to every G-code stream */
 static bool want_adaptive = false;
+static int want_separate;
+static int am_roughing = 0;
+static double rippem = 10000;
+static double safe_retract_height = 2;
+static double arc_tolerance = 0;
+static double merge_tolerance = 0;
+static bool want_staydown = false;
+/* rapid this far above the remaining stock instead of at safe_retract_height; 0 is off */
+static double low_rapid_margin = 0;
+/* where a stream named "-" goes; see gcode_stream_to_stdout() */
+static int stdout_fd = STDOUT_FILENO;
+/* NULL (and no line numbers) writes the generic output as is */
+static const struct gcode_dialect *dialect = NULL;
+static bool want_line_numbers = false;
+/* cycle time estimate; 0 acceleration means off */
+static double estimate_accel = 0;
+static double estimate_junction_deviation = 0.01;
+/* mm/min, for the estimate and the stay-down decisions */
+static double rapid_rate = 5000;
 
-static std::vector<struct gline *> lines;
+/*
+ * the active tool for toolpath planning; every gcode_writer keeps its own
+ * copy of the tool it is writing for
+ */
 static const char *tool_name = "T201";
-static int current_tool_nr = -499;
 static double tool_diameter = 6;
 static double tool_stepover = 3;
 static double tool_maxdepth = 1;
@@ -31,23 +61,6 @@ static double tool_feedrate = 0;
 static double tool_plungerate = 0;
 static double tool_angle = 0;
 static int tool_nr = 0;
-static double rippem = 10000;
-static double safe_retract_height = 2;
-static int want_separate;
-
-static char stored_filename[8192];
-static FILE *gcode;
-static int retract_count;
-static int mill_count;
-/* in mm */
-static double cX, cY, cZ, cS;
-static int has_current = 0;
-static int am_roughing = 0;
-
-/* for vcarving */
-
-static double prevX1, prevY1, prevX2, prevY2;
-static int prev_valid;
 
 static double dist(double X0, double Y0, double X1, double Y1)
 {
@@ -58,7 +71,7 @@ static double dist3(double X0, double Y0, double Z0, double X1, double Y1, doubl
   return sqrt((X1-X0)*(X1-X0) + (Y1-Y0)*(Y1-Y0) + (Z1-Z0)*(Z1-Z0));
 }
 
-static double radius_at_depth(double Z)
+double gcode_writer::radius_at_depth(double Z)
 {
 	double radius = tool_diameter / 2;
 	if (tool_angle == 0)
@@ -66,53 +79,520 @@ static double radius_at_depth(double Z)
 	return fmin(depth_to_radius(Z, tool_angle), radius);	
 }
 
-static void record_motion_XYZ(double fX, double fY, double fZ, double tX, double tY, double tZ)
+static inline int stock_coord(double v)
+{
+	return (int)floor(v / STOCK_RES);
+}
+
+struct stock_tile *gcode_writer::stock_find_tile(int x, int y, bool create)
+{
+	uint64_t key = ((uint64_t)(uint32_t)(x >> STOCK_TILE_SHIFT) << 32) | (uint32_t)(y >> STOCK_TILE_SHIFT);
+	struct stock_tile *tile = NULL;
+	int i;
+
+	if (key == last_tile_key)
+		return last_tile;
+
+	auto it = stock.find(key);
+	if (it != stock.end()) {
+		tile = it->second;
+	} else if (create) {
+		tile = (struct stock_tile *)malloc(sizeof(struct stock_tile));
+		for (i = 0; i < STOCK_TILE * STOCK_TILE; i++)
+			tile->Z[i] = 0;
+		stock[key] = tile;
+	}
+	if (tile) {
+		last_tile_key = key;
+		last_tile = tile;
+	}
+	return tile;
+}
+
+inline double gcode_writer::stock_height(int x, int y)
 {
-	struct gline *point;
+	struct stock_tile *tile = stock_find_tile(x, y, false);
+
+	if (!tile)
+		return 0;
+	return tile->Z[((y & (STOCK_TILE - 1)) << STOCK_TILE_SHIFT) | (x & (STOCK_TILE - 1))];
+}
 
-	if (!want_adaptive)
+/* lower the stock model to the surface swept by the tool along this move */
+void gcode_writer::record_motion_XYZ(double fX, double fY, double fZ, double tX, double tY, double tZ)
+{
+	double R, vX, vY, len2;
+	int x, y;
+
+	if (!want_adaptive && !want_staydown && low_rapid_margin <= 0)
 		return;
 
-	point = (struct gline*)calloc(sizeof(struct gline), 1);
-	point->X1 = fX;
-	point->X2 = tX;
-	point->Y1 = fY;
-	point->Y2 = tY;
-	point->Z1 = fZ;
-	point->Z2 = tZ;
+	R = fmax(radius_at_depth(fZ), radius_at_depth(tZ));
+	vX = tX - fX;
+	vY = tY - fY;
+	len2 = vX * vX + vY * vY;
+
+	for (y = stock_coord(fmin(fY, tY) - R); y <= stock_coord(fmax(fY, tY) + R); y++) {
+		for (x = stock_coord(fmin(fX, tX) - R); x <= stock_coord(fmax(fX, tX) + R); x++) {
+			double pX = (x + 0.5) * STOCK_RES;
+			double pY = (y + 0.5) * STOCK_RES;
+			double l = 0, d, Z;
+			struct stock_tile *tile;
+			float *cell;
+
+			if (len2 > 0)
+				l = fmin(fmax(((pX - fX) * vX + (pY - fY) * vY) / len2, 0), 1);
+			d = dist(fX + l * vX, fY + l * vY, pX, pY);
+			/*
+			 * only cells the tool covers completely count as cut, so that
+			 * the load samples on the rim of the tool see the previous
+			 * move's rim as uncut stock, like an exact model would
+			 */
+			if (d > R - STOCK_RES * M_SQRT1_2)
+				continue;
+
+			Z = fZ + l * (tZ - fZ);
+			if (tool_angle > 0.01)
+				Z -= radius_to_depth(d, tool_angle);
+			if (Z >= 0)
+				continue;
+
+			tile = stock_find_tile(x, y, true);
+			cell = &tile->Z[((y & (STOCK_TILE - 1)) << STOCK_TILE_SHIFT) | (x & (STOCK_TILE - 1))];
+			if (Z < *cell)
+				*cell = Z;
+		}
+	}
 
-	point->minX = fmin(fX - radius_at_depth(fZ), tX - radius_at_depth(tZ));
-	point->maxX = fmax(fX + radius_at_depth(fZ), tX + radius_at_depth(tZ));
-	point->minY = fmin(fY - radius_at_depth(fZ), tY - radius_at_depth(tZ));
-	point->maxY = fmax(fY + radius_at_depth(fZ), tY + radius_at_depth(tZ));
+	/*
+	 * A V-bit at a shallow depth can be narrower than a cell, and then no
+	 * cell is covered completely; the cells the tool center passes through
+	 * got cut all the same.
+	 */
+	if (R - STOCK_RES * M_SQRT1_2 < STOCK_RES * M_SQRT1_2) {
+		int steps = (int)ceil(sqrt(len2) / (STOCK_RES / 2)) + 1;
+		for (int i = 0; i <= steps; i++) {
+			double l = (double)i / steps;
+			double Z = fZ + l * (tZ - fZ);
+			struct stock_tile *tile;
+			float *cell;
+
+			if (Z >= 0)
+				continue;
+			x = stock_coord(fX + l * vX);
+			y = stock_coord(fY + l * vY);
+			tile = stock_find_tile(x, y, true);
+			cell = &tile->Z[((y & (STOCK_TILE - 1)) << STOCK_TILE_SHIFT) | (x & (STOCK_TILE - 1))];
+			if (Z < *cell)
+				*cell = Z;
+		}
+	}
+}
 
-	point->tool = current_tool_nr;
-	point->toolradius = tool_diameter / 2;
-	point->toolangle = tool_angle;
+/*
+ * Can the tool go from the current position straight to X,Y without leaving
+ * the current depth? Only if the stock model says that everything under the
+ * tool along the way is already down to this depth, so the link can't cut
+ * into a finished wall or island. It also has to be quicker than the
+ * retract, rapid and plunge it replaces.
+ */
+bool gcode_writer::link_is_clear(double X, double Y)
+{
+	double R, vX, vY, len2, len;
+	int x, y;
+
+	if (!want_staydown || !current_valid || tool_angle > 0.01 || cZ >= 0)
+		return false;
+
+	len = dist(cX, cY, X, Y);
+	if (len / tool_feedrate > (safe_retract_height - cZ) / rapid_rate + len / rapid_rate + (safe_retract_height - cZ) / tool_plungerate)
+		return false;
+
+	/* every cell under the tool, and at least the one its center is in */
+	R = fmax(radius_at_depth(cZ), STOCK_RES * M_SQRT1_2);
+	vX = X - cX;
+	vY = Y - cY;
+	len2 = vX * vX + vY * vY;
+
+	for (y = stock_coord(fmin(cY, Y) - R); y <= stock_coord(fmax(cY, Y) + R); y++) {
+		for (x = stock_coord(fmin(cX, X) - R); x <= stock_coord(fmax(cX, X) + R); x++) {
+			double pX = (x + 0.5) * STOCK_RES;
+			double pY = (y + 0.5) * STOCK_RES;
+			double l = 0;
+
+			if (len2 > 0)
+				l = fmin(fmax(((pX - cX) * vX + (pY - cY) * vY) / len2, 0), 1);
+			if (dist(cX + l * vX, cY + l * vY, pX, pY) > R)
+				continue;
+			if (stock_height(x, y) > cZ + 0.001)
+				return false;
+		}
+	}
+	return true;
+}
 
-	lines.push_back(point);
-//	printf("XYZ movement from %5.2f,%5.2f to %5.2f,%5.2f\n", currentX, currentY, X, Y);
+/* the highest point of the stock model anywhere the tool can touch on the way from the current position to X,Y */
+double gcode_writer::stock_top_along(double X, double Y)
+{
+	double R, vX, vY, len2, top = -10000;
+	int x, y;
+
+	R = tool_diameter / 2 + STOCK_RES * M_SQRT1_2;
+	vX = X - cX;
+	vY = Y - cY;
+	len2 = vX * vX + vY * vY;
+
+	for (y = stock_coord(fmin(cY, Y) - R); y <= stock_coord(fmax(cY, Y) + R); y++) {
+		for (x = stock_coord(fmin(cX, X) - R); x <= stock_coord(fmax(cX, X) + R); x++) {
+			double pX = (x + 0.5) * STOCK_RES;
+			double pY = (y + 0.5) * STOCK_RES;
+			double l = 0;
+
+			if (len2 > 0)
+				l = fmin(fmax(((pX - cX) * vX + (pY - cY) * vY) / len2, 0), 1);
+			if (dist(cX + l * vX, cY + l * vY, pX, pY) > R)
+				continue;
+			top = fmax(top, stock_height(x, y));
+			/* untouched stock, nothing can be higher */
+			if (top >= 0)
+				return top;
+		}
+	}
+	return top;
 }
 
-static char *double_to_str(double X)
+/*
+ * Output goes through a large user space buffer that gets handed to the kernel
+ * with a single write() per flush; coordinates are formatted as integer fixed
+ * point instead of going through sprintf().
+ */
+
+void gcode_writer::write_out(const char *data, unsigned int len)
 {
-	static char buffer[128];
-	char buf[96];
-	int x;
-	int i;
-	x = (int)(X * 10000);
+	unsigned int done = 0;
+
+	while (done < len && gcode >= 0) {
+		ssize_t ret = write(gcode, data + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printf("Error writing gcode: %s\n", strerror(errno));
+			break;
+		}
+		done += ret;
+	}
+}
+
+void gcode_writer::flush(void)
+{
+	if (estimate)
+		estimate->process(outbuf, outlen);
+	if (post) {
+		postbuf.clear();
+		post->process(outbuf, outlen, postbuf);
+		write_out(postbuf.data(), postbuf.size());
+	} else {
+		write_out(outbuf, outlen);
+	}
+	outlen = 0;
+}
+
+/* push everything written so far out to the file, for a reader that is following along */
+void gcode_writer::sync(void)
+{
+	flush_moves();
+	flush();
+}
+
+inline void gcode_writer::out_reserve(unsigned int len)
+{
+	if (outlen + len > GCODE_BUFFER_SIZE)
+		flush();
+}
+
+inline void gcode_writer::out_char(char c)
+{
+	out_reserve(1);
+	outbuf[outlen++] = c;
+}
+
+void gcode_writer::out_str(const char *str)
+{
+	unsigned int len = strlen(str);
+
+	if (len > GCODE_BUFFER_SIZE / 2) {
+		flush();
+		while (len--)
+			out_char(*str++);
+		return;
+	}
+	out_reserve(len);
+	memcpy(outbuf + outlen, str, len);
+	outlen += len;
+}
+
+void gcode_writer::out_printf(const char *fmt, ...)
+{
+	char line[4096];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+	out_str(line);
+}
+
+/* "%i" */
+inline void gcode_writer::out_int(char word, int value)
+{
+	char tmp[12];
+	unsigned int u;
+	int n = 0;
+
+	out_reserve(16);
+	outbuf[outlen++] = word;
+	if (value < 0)
+		outbuf[outlen++] = '-';
+	u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	while (n > 0)
+		outbuf[outlen++] = tmp[--n];
+}
+
+/*
+ * Truncate to 4 decimals, matching what sprintf("%05i"/"%06i") of X * 10000
+ * with a '.' inserted before the last four digits used to produce. That is
+ * as fine as any dialect goes; the postprocessor rounds each axis further.
+ */
+inline void gcode_writer::out_coord(char word, double X)
+{
+	char tmp[12];
+	int x = (int)(X * 10000);
+	unsigned int u;
+	int n = 0;
+	int width = 5;
+
+	out_reserve(20);
+	outbuf[outlen++] = word;
+	if (X < 0) {
+		if (x < 0)
+			outbuf[outlen++] = '-';
+		else
+			width = 6;
+	}
+	u = x < 0 ? 0u - (unsigned int)x : (unsigned int)x;
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	while (n < width)
+		tmp[n++] = '0';
+	while (n > 4)
+		outbuf[outlen++] = tmp[--n];
+	outbuf[outlen++] = '.';
+	while (n > 0)
+		outbuf[outlen++] = tmp[--n];
+}
+
+/*
+ * Arc fitting: when an arc tolerance is set, G1 moves are not written out
+ * right away but collected into a run. flush_moves() then looks for stretches
+ * of the run where all points (and the chords between them) are within the
+ * tolerance of a circle, and writes those as a single G2/G3.
+ *
+ * With a merge tolerance, stretches of the same run whose intermediate points
+ * are within that distance of the straight line from the first to the last
+ * point are written as a single G1.
+ */
+#define MAX_RUN 8192
+#define MAX_ARC_POINTS 1000
+#define MAX_ARC_RADIUS 10000
+#define MAX_MERGE_POINTS 1000
+
+void gcode_writer::emit_G1(const struct gmove *from, const struct gmove *to)
+{
+	out_str("G1");
+	if (from->X != to->X)
+		out_coord('X', to->X);
+	if (from->Y != to->Y)
+		out_coord('Y', to->Y);
+	if (from->Z != to->Z)
+		out_coord('Z', to->Z);
+	if (from->F != to->F)
+		out_int('F', (int)(to->F));
+	out_char('\n');
+}
+
+/*
+ * check if the start point plus moves[first .. first + count - 1] lie on one
+ * arc; returns the direction (-1 for clockwise, 1 for counter clockwise) or 0
+ */
+int gcode_writer::fit_arc(const struct gmove *start, unsigned int first, unsigned int count, double *cx, double *cy)
+{
+	const struct gmove *mid = &moves[first + count / 2 - 1];
+	const struct gmove *end = &moves[first + count - 1];
+	const struct gmove *prev;
+	double ax, ay, bx, by, det, r, sweep = 0;
+	int dir = 0;
+	unsigned int i;
+
+	/* circle through start, mid and end */
+	ax = mid->X - start->X;
+	ay = mid->Y - start->Y;
+	bx = end->X - start->X;
+	by = end->Y - start->Y;
+	det = 2 * (ax * by - ay * bx);
+	if (fabs(det) < 1e-12)
+		return 0;
+	*cx = start->X + (by * (ax * ax + ay * ay) - ay * (bx * bx + by * by)) / det;
+	*cy = start->Y + (ax * (bx * bx + by * by) - bx * (ax * ax + ay * ay)) / det;
+	r = dist(start->X, start->Y, *cx, *cy);
+	if (r > MAX_ARC_RADIUS)
+		return 0;
+
+	prev = start;
+	for (i = first; i < first + count; i++) {
+		const struct gmove *m = &moves[i];
+		double ux = prev->X - *cx, uy = prev->Y - *cy;
+		double vx = m->X - *cx, vy = m->Y - *cy;
+		double cross = ux * vy - uy * vx;
+		double chord = dist(prev->X, prev->Y, m->X, m->Y);
+
+		if (m->Z != start->Z || m->F != moves[first].F)
+			return 0;
+		if (fabs(dist(m->X, m->Y, *cx, *cy) - r) > arc_tolerance)
+			return 0;
+		/* the polyline segment bulges away from the arc by its sagitta */
+		if (chord >= 2 * r || r - sqrt(r * r - chord * chord / 4) > arc_tolerance)
+			return 0;
+		if (cross == 0)
+			return 0;
+		if (dir == 0)
+			dir = cross > 0 ? 1 : -1;
+		if ((cross > 0 ? 1 : -1) != dir)
+			return 0;
+		sweep += fabs(atan2(cross, ux * vx + uy * vy));
+		prev = m;
+	}
+
+	/* never close the circle, start and end would be ambiguous */
+	if (sweep > 2 * M_PI - 0.1)
+		return 0;
+	/* straight within tolerance; leave those as lines */
+	if (r * (1 - cos(sweep / 2)) < arc_tolerance)
+		return 0;
+	return dir;
+}
+
+static double dist_point_segment3(const struct gmove *a, const struct gmove *b, const struct gmove *p)
+{
+	double vx = b->X - a->X, vy = b->Y - a->Y, vz = b->Z - a->Z;
+	double len2 = vx * vx + vy * vy + vz * vz;
+	double l = 0;
+
+	if (len2 > 0)
+		l = ((p->X - a->X) * vx + (p->Y - a->Y) * vy + (p->Z - a->Z) * vz) / len2;
+	if (l < 0)
+		l = 0;
+	if (l > 1)
+		l = 1;
+	return dist3(a->X + l * vx, a->Y + l * vy, a->Z + l * vz, p->X, p->Y, p->Z);
+}
+
+/* can the start point plus moves[first .. first + count - 1] be one straight move */
+int gcode_writer::fit_line(const struct gmove *start, unsigned int first, unsigned int count)
+{
+	const struct gmove *end = &moves[first + count - 1];
+	unsigned int i;
+
+	if (end->F != moves[first].F)
+		return 0;
+	for (i = first; i < first + count - 1; i++) {
+		if (moves[i].F != end->F)
+			return 0;
+		if (dist_point_segment3(start, end, &moves[i]) > merge_tolerance)
+			return 0;
+	}
+	return 1;
+}
+
+void gcode_writer::flush_moves(void)
+{
+	struct gmove prev = run_start;
+	unsigned int i = 0, n = moves.size();
+
+	while (i < n) {
+		unsigned int count, best = 0;
+		double cx, cy, bestX = 0, bestY = 0;
+		int dir, bestdir = 0;
+
+		for (count = 3; arc_tolerance > 0 && count <= MAX_ARC_POINTS && i + count <= n; count++) {
+			dir = fit_arc(&prev, i, count, &cx, &cy);
+			if (!dir)
+				break;
+			best = count;
+			bestdir = dir;
+			bestX = cx;
+			bestY = cy;
+		}
+
+		if (best == 0) {
+			best = 1;
+			for (count = 2; merge_tolerance > 0 && count <= MAX_MERGE_POINTS && i + count <= n; count++) {
+				if (!fit_line(&prev, i, count))
+					break;
+				best = count;
+			}
+			emit_G1(&prev, &moves[i + best - 1]);
+			prev = moves[i + best - 1];
+			i += best;
+			continue;
+		}
+
+		struct gmove *end = &moves[i + best - 1];
+		out_str(bestdir < 0 ? "G2" : "G3");
+		if (prev.X != end->X)
+			out_coord('X', end->X);
+		if (prev.Y != end->Y)
+			out_coord('Y', end->Y);
+		out_coord('I', bestX - prev.X);
+		out_coord('J', bestY - prev.Y);
+		if (prev.F != end->F)
+			out_int('F', (int)(end->F));
+		out_char('\n');
+		prev = *end;
+		i += best;
+	}
+	moves.clear();
+}
+
+void gcode_writer::queue_G1(double X, double Y, double Z, double F)
+{
+	struct gmove m = {X, Y, Z, F};
+	struct gmove current = {cX, cY, cZ, cS};
 
-	if (X < 0)
-		sprintf(buf, "%06i", x);
-	else
-		sprintf(buf, "%05i", x);
+	if (arc_tolerance <= 0 && merge_tolerance <= 0) {
+		emit_G1(&current, &m);
+		return;
+	}
+	if (moves.empty())
+		run_start = current;
+	moves.push_back(m);
+	if (moves.size() >= MAX_RUN)
+		flush_moves();
+}
 
-	strcpy(buffer, buf);
-	i = strlen(buf) - 4;
-	buffer[i] = '.';
-	strcpy(buffer + i + 1, buf + i);
-	//printf("Double %5.4f to string %s \n", X, buffer);
-	return buffer;
+void gcode_set_arc_tolerance(double tolerance_mm)
+{
+	arc_tolerance = tolerance_mm;
+}
+
+void gcode_set_merge_tolerance(double tolerance_mm)
+{
+	merge_tolerance = tolerance_mm;
 }
 
 void set_tool_imperial(const char *name, int nr, double diameter_inch, double stepover_inch, double maxdepth_inch, double feedrate_ipm, double plungerate_ipm)
@@ -125,8 +605,6 @@ void set_tool_imperial(const char *name, int nr, double diameter_inch, double st
     tool_plungerate = ipm_to_metric(plungerate_ipm);
 	tool_angle = get_tool_angle(nr);
 	tool_nr = nr;
-    prev_valid = 0;
-	has_current = 0;
 }
 
 void set_tool_metric(const char *name, int nr, double diameter_mm, double stepover_mm, double maxdepth_mm, double feedrate_metric, double plungerate_metric)
@@ -139,8 +617,6 @@ void set_tool_metric(const char *name, int nr, double diameter_mm, double stepov
     tool_plungerate = plungerate_metric;
 	tool_angle = get_tool_angle(nr);
 	tool_nr = nr;
-    prev_valid = 0;
-	has_current = 0;
 }
 
 double get_tool_diameter(void)
@@ -177,8 +653,85 @@ double get_retract_height_metric(void)
     return safe_retract_height;
 }
 
-static int iter = 0;
-void write_gcode_header(const char *filename)
+double gcode_get_rapid_rate(void)
+{
+    return rapid_rate;
+}
+
+gcode_writer::gcode_writer()
+{
+	gcode = -1;
+	stored_filename[0] = 0;
+	iter = 0;
+	outbuf = (char *)malloc(GCODE_BUFFER_SIZE);
+	outlen = 0;
+	post = NULL;
+	if (dialect || want_line_numbers)
+		post = new postprocessor(dialect ? dialect : find_dialect("generic"), want_line_numbers);
+	estimate = NULL;
+	if (estimate_accel > 0)
+		estimate = new estimator(estimate_accel, estimate_junction_deviation, rapid_rate / 60);
+
+	current_tool_nr = -499;
+	first_time = 1;
+	tool_diameter = 6;
+	tool_stepover = 3;
+	tool_maxdepth = 1;
+	tool_feedrate = 0;
+	tool_plungerate = 0;
+	tool_angle = 0;
+	tool_nr = 0;
+
+	cX = 0;
+	cY = 0;
+	cZ = 0;
+	cS = 0;
+	current_valid = 0;
+	retract_count = 0;
+	mill_count = 0;
+
+	prevX1 = prevY1 = prevX2 = prevY2 = 0;
+	prev_valid = 0;
+
+	run_start = {0, 0, 0, 0};
+	last_tile_key = ~0ULL;
+	last_tile = NULL;
+}
+
+gcode_writer::~gcode_writer()
+{
+	if (gcode >= 0) {
+		flush();
+		close(gcode);
+	}
+	free(outbuf);
+	delete post;
+	delete estimate;
+	for (auto tile : stock)
+		free(tile.second);
+}
+
+/* the output side equivalent of activate_tool() */
+void gcode_writer::activate_tool(int nr)
+{
+	class endmill *mill;
+
+	nr = abs(nr);
+	mill = get_endmill(nr);
+	if (!mill)
+		return;
+	tool_diameter = mill->get_diameter();
+	tool_stepover = mill->get_stepover();
+	tool_maxdepth = mill->get_depth_of_cut();
+	tool_feedrate = mill->get_feedrate();
+	tool_plungerate = mill->get_plungerate();
+	tool_angle = get_tool_angle(nr);
+	tool_nr = nr;
+	prev_valid = 0;
+	current_valid = 0;
+}
+
+void gcode_writer::write_header(const char *filename)
 {
 	char actual_filename[8392];
 	if (strlen(stored_filename) == 0) {
@@ -195,95 +748,68 @@ void write_gcode_header(const char *filename)
 
 	
 
-    gcode = fopen(actual_filename, "w");
-    if (!gcode) {
+    if (strcmp(actual_filename, "-") == 0)
+        gcode = dup(stdout_fd);
+    else
+        gcode = open(actual_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (gcode < 0) {
         printf("Cannot open %s for gcode output: %s\n", filename, strerror(errno));
         return;
     }
-    fprintf(gcode, "%%\n");
-    fprintf(gcode, "G21\n"); /* milimeters not imperials */
-    fprintf(gcode, "G90\n"); /* all relative to work piece zero */
-    fprintf(gcode, "G0X0Y0Z%5.4f\n", safe_retract_height);
+    if (post)
+        post->reset();
+    if (estimate)
+        estimate->reset();
+    out_str("%\n");
+    out_str("G21\n"); /* milimeters not imperials */
+    out_str("G90\n"); /* all relative to work piece zero */
+    out_printf("G0X0Y0Z%5.4f\n", safe_retract_height);
     cZ = safe_retract_height;
-    fprintf(gcode, "(FILENAME: %s)\n", filename);
+    out_printf("(FILENAME: %s)\n", filename);
+    if (arc_tolerance > 0)
+        out_str("G17\n"); /* arcs are in the XY plane */
 }
 
-void gcode_plunge_to(double Z, double speedratio)
+void gcode_writer::plunge_to(double Z, double speedratio)
 {
-    fprintf(gcode, "G1");
+    flush_moves();
+    out_str("G1");
     if (cZ != Z)
-        fprintf(gcode,"Z%5.4f", Z);
+        out_printf("Z%5.4f", Z);
     if (cS != speedratio)
-        fprintf(gcode, "F%i", (int)(speedratio * tool_plungerate) );
+        out_int('F', (int)(speedratio * tool_plungerate));
     cZ = Z;
     cS = speedratio * tool_plungerate;
     prev_valid = 0;
-	has_current = 1;
-    fprintf(gcode, "\n");
+	current_valid = 1;
+    out_char('\n');
 }
 
-void gcode_retract(void)
+void gcode_writer::retract(void)
+{
+    retract_to(safe_retract_height);
+}
+
+void gcode_writer::retract_to(double Z)
 {
 //    printf("retract\n");
-    fprintf(gcode, "G0");
-    if (cZ != safe_retract_height)
-        fprintf(gcode,"Z%s", double_to_str(safe_retract_height));
-    cZ = safe_retract_height;
-    fprintf(gcode, "\n");
+    flush_moves();
+    out_str("G0");
+    if (cZ != Z)
+        out_coord('Z', Z);
+    cZ = Z;
+    out_char('\n');
     retract_count++;
     prev_valid = 0;
-	has_current = 1;
+	current_valid = 1;
 }
 
-static double gcode_depth_at_XY(double X, double Y)
-{
-	double depth = 2;
-	unsigned int i;
-	
-	for (i = 0; i < lines.size(); i++) {
-		double d;
-		double l;
-		double baseZ;
-		double adjust = 0;
-		if (X < lines[i]->minX)
-			continue;
-		if (X > lines[i]->maxX)
-			continue;
-		if (Y < lines[i]->minY)
-			continue;
-		if (Y > lines[i]->maxY)
-			continue;
-
-		d = distance_point_from_vector_ll(lines[i]->X1, lines[i]->Y1, lines[i]->X2, lines[i]->Y2, X, Y, &l);	
-
-		if (d  > lines[i]->toolradius)
-			continue;
-
-		baseZ = lines[i]->Z1 + l * (lines[i]->Z2 - lines[i]->Z1);
-
-		if (lines[i]->toolangle > 0.01) {
-			adjust -= radius_to_depth(d, lines[i]->toolangle);
-
-		}
-
-//		vprintf("XY %5.4f %5.4f    line %5.4f,%5.4f -> %5.4f,%5.4f tool %i at dist %5.4f   est Z %5.4f + %5.4f = %5.4f\n",
-//			X, Y, lines[i]->X1, lines[i]->Y1, lines[i]->X2, lines[i]->Y2, lines[i]->tool, d, baseZ, adjust, baseZ + adjust);
-
-		baseZ += adjust;
-		depth = fmin(depth, baseZ);
-	}
-
-	if (depth > 0)
-		depth = 0;
-
-	return depth;
-}
-static double gcode_point_load(double X, double Y, double Z)
+double gcode_writer::point_load(double X, double Y, double Z)
 {
 	double Z2;
 	double delta;
 
-	Z2 = gcode_depth_at_XY(X, Y);
+	Z2 = stock_height(stock_coord(X), stock_coord(Y));
 
 	if (Z2 <= Z)
 		return 0;
@@ -291,7 +817,7 @@ static double gcode_point_load(double X, double Y, double Z)
 	return delta / tool_maxdepth;
 }
 
-static double gcode_area_load(double X1, double Y1, double Z1, double X2, double Y2, double Z2, double *lout)
+double gcode_writer::area_load(double X1, double Y1, double Z1, double X2, double Y2, double Z2, double *lout)
 {
 	double vx, vy, vz;
 	double nx,ny;
@@ -334,41 +860,68 @@ static double gcode_area_load(double X1, double Y1, double Z1, double X2, double
 	nx = nx / len;
 	ny = ny / len;
 
-	do {
-		int i;
-		double local = 0;
-		for (i = 0; i < SAMPLES; i++) {
-			local += gcode_point_load(X1 + (l + R * sampleX[i]) * vx + R * sampleY[i] * nx, Y1 + (l + R * sampleX[i]) * vy + R * sampleY[i] * ny, Z1  + l * vz);
+	/*
+	 * the steps are evaluated in batches: first the sample positions of
+	 * STEP_BATCH steps are computed in one go (which the compiler turns into
+	 * SIMD), then their loads are looked up in the stock model, and only then
+	 * the per step running average is checked for a reason to split the move
+	 */
+	#define STEP_BATCH 8
+	while (l <= maxl) {
+		double steps[STEP_BATCH];
+		double pX[STEP_BATCH * SAMPLES], pY[STEP_BATCH * SAMPLES], pZ[STEP_BATCH * SAMPLES];
+		double load[STEP_BATCH * SAMPLES];
+		int n = 0, i, k;
+
+		while (n < STEP_BATCH && l <= maxl) {
+			steps[n++] = l;
+			if (l < maxl - stepsize || l == maxl) {
+			    l = l + stepsize;
+			} else {
+				if (l != maxl)
+					l = maxl;
+				else
+					l = l + stepsize;
+			}
+		}
+
+		for (k = 0; k < n; k++) {
+			for (i = 0; i < SAMPLES; i++) {
+				pX[k * SAMPLES + i] = X1 + (steps[k] + R * sampleX[i]) * vx + R * sampleY[i] * nx;
+				pY[k * SAMPLES + i] = Y1 + (steps[k] + R * sampleX[i]) * vy + R * sampleY[i] * ny;
+				pZ[k * SAMPLES + i] = Z1  + steps[k] * vz;
+			}
 		}
 
-		if (lout && count > 0 && prevl >= 0.01 && l != maxl) {
-			double avg1, avg2;
-			avg1 = sum / count;
-			avg2 = local / SAMPLES;
+		for (i = 0; i < n * SAMPLES; i++)
+			load[i] = point_load(pX[i], pY[i], pZ[i]);
 
-//			printf("Avg1 %5.4f   avg2  %5.4f  l %5.4f  prevl %5.4f   X1 %5.4f  Y1 %5.4f  X2 %5.4f  Y2 %5.4f\n", avg1, avg2, l, prevl, X1, Y1, X2, Y2);
+		for (k = 0; k < n; k++) {
+			double local = 0;
+			double sl = steps[k];
 
-			if (fabs(avg1-avg2) > 0.1) {
-				/* we're more than points% off... lets stop right here */
-				*lout = prevl;
-				return avg1;
+			for (i = 0; i < SAMPLES; i++)
+				local += load[k * SAMPLES + i];
+
+			if (lout && count > 0 && prevl >= 0.01 && sl != maxl) {
+				double avg1, avg2;
+				avg1 = sum / count;
+				avg2 = local / SAMPLES;
+
+//				printf("Avg1 %5.4f   avg2  %5.4f  l %5.4f  prevl %5.4f   X1 %5.4f  Y1 %5.4f  X2 %5.4f  Y2 %5.4f\n", avg1, avg2, sl, prevl, X1, Y1, X2, Y2);
+
+				if (fabs(avg1-avg2) > 0.1) {
+					/* we're more than points% off... lets stop right here */
+					*lout = prevl;
+					return avg1;
+				}
 			}
+
+			sum += local;
+			count += SAMPLES;
+			prevl = sl;
 		}
-		
-		sum += local;
-		count += SAMPLES;
-
-
-		prevl = l;
-		if (l < maxl - stepsize || l == maxl) {
-		    l = l + stepsize;
-		} else { 
-			if (l != maxl)
-				l = maxl;
-			else
-				l = l + stepsize;
-		}
-	} while (l <= maxl);
+	}
 
 	if (count > 0)
 		sum = sum / count;
@@ -381,11 +934,11 @@ static double gcode_area_load(double X1, double Y1, double Z1, double X2, double
 }
 
 
-void gcode_mill_to(double X, double Y, double Z, double speedratio)
+void gcode_writer::mill_to(double X, double Y, double Z, double speedratio)
 {
 	char comment[4095];
     if (cZ != Z) {
-        gcode_plunge_to(Z, speedratio);
+        plunge_to(Z, speedratio);
 	}
 
 	/* slow start and stop for long distances */
@@ -397,9 +950,9 @@ void gcode_mill_to(double X, double Y, double Z, double speedratio)
 		vX /= len;
 		vY /= len;
 
-		gcode_mill_to(cX + vX * tool_diameter/2, cY + vY * tool_diameter/2, Z, 0.66);
-		gcode_mill_to(X - vX * tool_diameter/2, Y - vY * tool_diameter/2, Z, 1.01);
-		gcode_mill_to(X, Y, Z, 0.66);
+		mill_to(cX + vX * tool_diameter/2, cY + vY * tool_diameter/2, Z, 0.66);
+		mill_to(X - vX * tool_diameter/2, Y - vY * tool_diameter/2, Z, 1.01);
+		mill_to(X, Y, Z, 0.66);
 		return;
 	} 
 
@@ -411,11 +964,11 @@ void gcode_mill_to(double X, double Y, double Z, double speedratio)
 		vX /= len;
 		vY /= len;
 
-		double load = gcode_area_load(cX, cY, cZ, X, Y, Z, &len);
+		double load = area_load(cX, cY, cZ, X, Y, Z, &len);
 
 		if (len != 10000) {
-			gcode_mill_to(cX + len * vX, cY + len * vY, Z, speedratio);
-			gcode_mill_to(X, Y, Z, speedratio);
+			mill_to(cX + len * vX, cY + len * vY, Z, speedratio);
+			mill_to(X, Y, Z, speedratio);
 			return;
 		}
 		
@@ -428,7 +981,7 @@ void gcode_mill_to(double X, double Y, double Z, double speedratio)
 		}
 		if (verbose) {
 			sprintf(comment, "Area load for next move is %5.4f with speed ratio %5.4f", load, speedratio);
-			gcode_write_comment(comment);
+			write_comment(comment);
 		}
 	}
 	
@@ -437,28 +990,19 @@ void gcode_mill_to(double X, double Y, double Z, double speedratio)
 	if (dist(cX,cY,X,Y) < 0.3 * tool_diameter && speedratio > 0.66 && !want_adaptive)
 		speedratio = 0.66;
 
-    fprintf(gcode, "G1");
-    if (cX != X)
-        fprintf(gcode,"X%s", double_to_str(X));
-    if (cY != Y)
-        fprintf(gcode,"Y%s", double_to_str(Y));
-    if (cZ != Z)
-		fprintf(gcode,"Z%s", double_to_str(Z));
-	if (cS != speedratio * tool_feedrate)
-		fprintf(gcode, "F%i", (int)(speedratio * tool_feedrate));
+	queue_G1(X, Y, Z, speedratio * tool_feedrate);
 
 	record_motion_XYZ(cX,cY,cZ, X,Y,Z);
     cX = X;
     cY = Y;
     cZ = Z;
-	has_current = 1;
+	current_valid = 1;
     cS = speedratio * tool_feedrate;
-    fprintf(gcode, "\n");
     mill_count++;
     prev_valid = 0;
 }
 
-void gcode_vmill_to(double X, double Y, double Z, double speedratio)
+void gcode_writer::vmill_to(double X, double Y, double Z, double speedratio)
 {
 	double d;
 	double toolspeed;
@@ -480,13 +1024,12 @@ void gcode_vmill_to(double X, double Y, double Z, double speedratio)
 		vX /= len;
 		vY /= len;
 
-		gcode_vmill_to(cX + vX * tool_diameter/2, cY + vY * tool_diameter/2, Z, 0.66);
-		gcode_vmill_to(X - vX * tool_diameter/2, Y - vY * tool_diameter/2, Z, 1.01);
-		gcode_vmill_to(X, Y, Z, 0.66);
+		vmill_to(cX + vX * tool_diameter/2, cY + vY * tool_diameter/2, Z, 0.66);
+		vmill_to(X - vX * tool_diameter/2, Y - vY * tool_diameter/2, Z, 1.01);
+		vmill_to(X, Y, Z, 0.66);
 		return;
 	} 
 
-    fprintf(gcode, "G%c", command);
     prevX1 = cX;
     prevY1 = cY;
     prevX2 = X;
@@ -501,69 +1044,97 @@ void gcode_vmill_to(double X, double Y, double Z, double speedratio)
 		speedratio = 0.66;
 //	record_motion_XYZ(cX,cY,cZ, X,Y,Z);
 
+	toolspeed = ceil(speedratio * toolspeed /10)*10;
 
-    if (cX != X) {
-        fprintf(gcode,"X%s", double_to_str(X));
-	    cX = X;
+	if (command == '1') {
+		queue_G1(X, Y, Z, toolspeed);
+		cS = toolspeed;
+	} else {
+		flush_moves();
+		out_str("G0");
+		if (cX != X)
+			out_coord('X', X);
+		if (cY != Y)
+			out_coord('Y', Y);
+		if (cZ != Z)
+			out_coord('Z', Z);
+		out_char('\n');
 	}
-    if (cY != Y) {
-        fprintf(gcode,"Y%s", double_to_str(Y));
-	    cY = Y;
-	}
-
 
-	toolspeed = ceil(speedratio * toolspeed /10)*10;
-
-    if (cZ != Z)
-        fprintf(gcode,"Z%s", double_to_str(Z));
-    if (cS != toolspeed && command == '1')
-        fprintf(gcode, "F%i", (int)(toolspeed));
-        
-    prev_valid = 1;
-	has_current = 1;
+    cX = X;
+    cY = Y;
     cZ = Z;
-	if (command == '1')
-	    cS = toolspeed;
-    fprintf(gcode, "\n");
+    prev_valid = 1;
+	current_valid = 1;
     mill_count++;
 }
 
-void gcode_travel_to(double X, double Y)
+void gcode_writer::travel_to(double X, double Y)
 {
     char buffer[256];
     sprintf(buffer,"Travel distance %5.4fmm", dist(X, Y, cX, cY));
-    gcode_write_comment(buffer);
-    if (cZ < safe_retract_height)
-        gcode_retract();
-    fprintf(gcode, "G0");
+    write_comment(buffer);
+    flush_moves();
+    if (low_rapid_margin > 0) {
+        /* only as high as the stock along the way requires */
+        double Z = fmin(stock_top_along(X, Y) + low_rapid_margin, safe_retract_height);
+        if (cZ < Z)
+            retract_to(Z);
+    } else if (cZ < safe_retract_height)
+        retract();
+    out_str("G0");
     if (cX != X)
-        fprintf(gcode,"X%s", double_to_str(X));
+        out_coord('X', X);
     if (cY != Y)
-        fprintf(gcode,"Y%s", double_to_str(Y));
+        out_coord('Y', Y);
     cX = X;
     cY = Y;
-    fprintf(gcode, "\n");
+    out_char('\n');
     prev_valid = 0;
 }
 
-void gcode_conditional_travel_to(double X, double Y, double Z, double speed)
+/* with low rapids, come down in rapid to just above what is left of the stock here, or of the cut to come */
+void gcode_writer::rapid_down_to(double Z)
+{
+    double top;
+
+    if (low_rapid_margin <= 0)
+        return;
+    top = fmax(stock_top_along(cX, cY), Z) + low_rapid_margin;
+    if (top >= cZ)
+        return;
+    flush_moves();
+    out_str("G0");
+    out_coord('Z', top);
+    out_char('\n');
+    cZ = top;
+}
+
+void gcode_writer::conditional_travel_to(double X, double Y, double Z, double speed)
 {
     if (cX == X && cY == Y && cZ == Z)
         return;
         
     /* rounding error handling: if we're within 0.01 mm just mill to it */
     if (cZ == Z && dist(X,Y,cX,cY) < 0.07) {
-        gcode_vmill_to(X, Y, Z, speed);
+        vmill_to(X, Y, Z, speed);
         return;
     }
-    if (cX !=X || cY != Y)
-     gcode_travel_to(X, Y);
+    if (cZ == Z && link_is_clear(X, Y)) {
+        write_comment("Staying down");
+        mill_to(X, Y, Z, speed);
+        return;
+    }
+    if (cX !=X || cY != Y) {
+     travel_to(X, Y);
+     rapid_down_to(Z);
+    }
     if (Z > 0)
-        gcode_plunge_to(Z, speed);
+        plunge_to(Z, speed);
         
 }
 
-void gcode_vconditional_travel_to(double X, double Y, double Z, double speed, double nextX, double nextY, double nextZ)
+void gcode_writer::vconditional_travel_to(double X, double Y, double Z, double speed, double nextX, double nextY, double nextZ)
 {
     double pX, pY;
     if (approx4(cX, X) && approx4(cY, Y) && approx4(cZ,Z))
@@ -571,28 +1142,28 @@ void gcode_vconditional_travel_to(double X, double Y, double Z, double speed, do
 
 //    printf("Travel to %5.4f %5.4f %5.4f\n", X, Y, Z);
     if (dist3(X,Y,Z,cX,cY,cZ) < 0.05) {
-        gcode_vmill_to(X, Y, Z, speed);
+        vmill_to(X, Y, Z, speed);
         return;
     }
 
 // if both soure and target are above 0, consider just millting to it */
     if (dist3(X,Y,Z,cX,cY,cZ) < 20 && Z > 0 && cZ > 0) {
-        gcode_vmill_to(X, Y, Z, speed);
+        vmill_to(X, Y, Z, speed);
         return;
     }
         
 
     /* can we just go back */
     if (Z == nextZ && prev_valid && dist(prevX1, prevY1, X,Y) < 0.005) {
-         gcode_write_comment("Going back");
-         gcode_vmill_to(X, Y, Z, speed);
+         write_comment("Going back");
+         vmill_to(X, Y, Z, speed);
     }  else
     /* we have cases where due to math precision, it's easier to go back a bit over the existing line  */
     if (Z == nextZ && prev_valid && vector_intersects_vector(prevX1, prevY1, prevX2, prevY2, X, Y, nextX, nextY, &pX, &pY)) {
          if (dist(pX,pY, cX,cY) + dist(pX,pY, X,Y) < fabs(3 * Z)) {
-            gcode_write_comment("Split X toolpath");
-            gcode_vmill_to(pX,pY, Z, speed);
-            gcode_vmill_to(X,Y, Z, speed);
+            write_comment("Split X toolpath");
+            vmill_to(pX,pY, Z, speed);
+            vmill_to(X,Y, Z, speed);
 //          printf("HAVE GOOD PATH %5.2fx%5.2f \n", pX, pY);
 //          printf("D1 is %5.4f\n", dist(pX,pY, cX,cY));
 //          printf("D2 is %5.4f\n", dist(pX,pY, X,Y));
@@ -605,15 +1176,17 @@ void gcode_vconditional_travel_to(double X, double Y, double Z, double speed, do
          }
     }
         
-    if (cX !=X || cY != Y)
-     gcode_travel_to(X, Y);
+    if (cX !=X || cY != Y) {
+     travel_to(X, Y);
+     rapid_down_to(Z);
+    }
     if (Z <= 0)
-        gcode_plunge_to(Z, speed);
+        plunge_to(Z, speed);
         
 }
 
 
-int gcode_vconditional_would_retract(double X, double Y, double Z, double speed, double nextX, double nextY, double nextZ)
+int gcode_writer::vconditional_would_retract(double X, double Y, double Z, double speed, double nextX, double nextY, double nextZ)
 {
     double pX, pY;
     if (cX == X && cY == Y && cZ == Z)
@@ -640,68 +1213,77 @@ int gcode_vconditional_would_retract(double X, double Y, double Z, double speed,
 
 
 
-void gcode_write_comment(const char *comment)
+void gcode_writer::write_comment(const char *comment)
 {
-    fprintf(gcode, "(%s)\n", comment);
+    flush_moves();
+    out_char('(');
+    out_str(comment);
+    out_str(")\n");
 }
 
-void write_gcode_footer(void)
+void gcode_writer::write_footer(void)
 {
-    gcode_retract();
-    fprintf(gcode, "M5\n");
-    fprintf(gcode, "M30\n");
-    fprintf(gcode, "(END)\n");
-    fprintf(gcode, "%%\n");
-    fclose(gcode);
+    retract();
+    if (estimate) {
+        char t[32];
+        std::string report;
+
+        flush();
+        estimate->finish();
+        estimate->report(report);
+        /* a dialect that drops comments would drop the whole report; this keeps it */
+        if (post) {
+            postbuf.clear();
+            post->process_notes(report.data(), report.size(), postbuf);
+            write_out(postbuf.data(), postbuf.size());
+        } else {
+            write_out(report.data(), report.size());
+        }
+        snprintf(t, sizeof(t), "%i:%02i", (int)(estimate->total() / 3600), (int)(estimate->total() / 60) % 60);
+        qprintf("Estimated cycle time for %s: %s\n", stored_filename, t);
+    }
+    out_str("M5\n");
+    out_str("M30\n");
+    out_str("(END)\n");
+    out_str("%\n");
+    flush();
+    close(gcode);
+    gcode = -1;
     vprintf("There were %i retracts in the file and %i milling toolpaths\n", retract_count, mill_count);
 }
 
-double gcode_current_X(void)
-{
-    return cX;
-}
-
-double gcode_current_Y(void)
-{
-    return cY;
-}
-
-static int first_time = 1;
-void gcode_tool_change(int toolnr)
+void gcode_writer::tool_change(int toolnr)
 {
  if (toolnr == current_tool_nr) 
    return;
+ flush_moves();
  if (!first_time) {
-  gcode_retract();
+  retract();
   if (!want_separate)
-	  fprintf(gcode, "M5\n");
+	  out_str("M5\n");
  }
  current_tool_nr = toolnr;
- activate_tool(toolnr); 
+ activate_tool(toolnr);
  if (want_separate && !first_time) {
-		write_gcode_footer();
-		write_gcode_header(stored_filename);
+		write_footer();
+		write_header(stored_filename);
  }
- fprintf(gcode, "M6 T%i\n", abs(toolnr));
- fprintf(gcode, "M3 S%i\n", (int)rippem);  
- fprintf(gcode, "G0 X0Y0\n");
+ out_printf("M6 T%i\n", abs(toolnr));
+ out_printf("M3 S%i\n", (int)rippem);
+ out_str("G0 X0Y0\n");
  first_time = 0;
     prev_valid = 0;
-	has_current = 0;
+	current_valid = 0;
 
 	cX = 0;
 	cY = 0;
 	cZ = 500000;	
 }
 
-int gcode_has_current(void)
-{
-	return has_current;
-}
-
-void gcode_reset_current(void)
+void gcode_writer::reset_current(void)
 {
-	has_current = 0;
+	flush_moves();
+	current_valid = 0;
 	cS = 0;
 	cX = -500000;
 	cY = -500000;
@@ -718,7 +1300,62 @@ void gcode_want_separate_files(void)
 	want_separate = 1;
 }
 
+int gcode_separate_files(void)
+{
+	return want_separate;
+}
+
+int gcode_is_adaptive(void)
+{
+	return want_adaptive;
+}
+
 void gcode_want_adaptive(void)
 {
 	want_adaptive = true;
-}
\ No newline at end of file
+}
+
+/* returns -1 for a dialect we don't know */
+int gcode_set_dialect(const char *name)
+{
+	const struct gcode_dialect *d = find_dialect(name);
+
+	if (!d)
+		return -1;
+	dialect = d;
+	return 0;
+}
+
+void gcode_want_line_numbers(void)
+{
+	want_line_numbers = true;
+}
+
+void gcode_want_staydown(void)
+{
+	want_staydown = true;
+}
+
+void gcode_set_low_rapids(double margin_mm)
+{
+	low_rapid_margin = margin_mm;
+}
+
+/* mm/s^2, mm and mm/min */
+void gcode_want_estimate(double accel, double junction_deviation, double rapid)
+{
+	estimate_accel = accel;
+	estimate_junction_deviation = junction_deviation;
+	rapid_rate = rapid;
+}
+
+/*
+ * G-code written to "-" goes to the real stdout; everything else that would
+ * have been printed there moves to stderr so it can't corrupt the stream.
+ */
+void gcode_stream_to_stdout(void)
+{
+	fflush(stdout);
+	stdout_fd = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+}
@@ -1,13 +1,129 @@
 #pragma once
 
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
 
-struct gline {
-	double X1, Y1, Z1;
-	double X2, Y2, Z2;
+/*
+ * The stock model used for adaptive feeds is a sparse heightmap: the XY plane
+ * is cut into tiles of STOCK_TILE x STOCK_TILE cells, which get allocated the
+ * first time a move reaches into them. Each cell holds the current top of the
+ * stock at its center; untouched stock is at Z = 0.
+ */
+#define STOCK_RES 0.2
+#define STOCK_TILE_SHIFT 6
+#define STOCK_TILE (1 << STOCK_TILE_SHIFT)
 
-	double toolradius;
-	double toolangle;
-	int tool;
+struct stock_tile {
+	float Z[STOCK_TILE * STOCK_TILE];
+};
+
+/* a G1 move waiting for arc fitting / collinear merging */
+struct gmove {
+	double X, Y, Z, F;
+};
+
+#define GCODE_BUFFER_SIZE (1024 * 1024)
+
+class postprocessor;
+class estimator;
+
+/*
+ * One G-code output stream. Everything that belongs to the stream lives in
+ * here: the output file and its buffer, the current position, the tool being
+ * written for, the pending moves and the stock model. Independent streams can
+ * therefore be written from different threads at the same time.
+ */
+class gcode_writer {
+public:
+	gcode_writer();
+	~gcode_writer();
+
+	void set_file_number(int nr) { iter = nr - 1; };
+	void write_header(const char *filename);
+	void write_footer(void);
+	void write_comment(const char *comment);
+	void tool_change(int toolnr);
+	void activate_tool(int toolnr);
+	void sync(void);
+
+	void mill_to(double X, double Y, double Z, double speedratio);
+	void vmill_to(double X, double Y, double Z, double speedratio);
+	void plunge_to(double Z, double speedratio);
+	void retract(void);
+	void travel_to(double X, double Y);
+	void conditional_travel_to(double X, double Y, double Z, double speed);
+	void vconditional_travel_to(double X, double Y, double Z, double speed, double nextX, double nextY, double nextZ);
+	int vconditional_would_retract(double X, double Y, double Z, double speed, double nextX, double nextY, double nextZ);
+
+	double current_X(void) { return cX; };
+	double current_Y(void) { return cY; };
+	int has_current(void) { return current_valid; };
+	void reset_current(void);
+
+private:
+	/* output file */
+	int gcode;
+	char stored_filename[8192];
+	int iter;
+	char *outbuf;
+	unsigned int outlen;
+	class postprocessor *post;
+	std::string postbuf;
+	class estimator *estimate;
+
+	/* the tool being written for */
+	int current_tool_nr;
+	int first_time;
+	double tool_diameter;
+	double tool_stepover;
+	double tool_maxdepth;
+	double tool_feedrate;
+	double tool_plungerate;
+	double tool_angle;
+	int tool_nr;
+
+	/* in mm */
+	double cX, cY, cZ, cS;
+	int current_valid;
+	int retract_count;
+	int mill_count;
+
+	/* for vcarving */
+	double prevX1, prevY1, prevX2, prevY2;
+	int prev_valid;
+
+	std::vector<struct gmove> moves;
+	struct gmove run_start;
+
+	std::unordered_map<uint64_t, struct stock_tile *> stock;
+	uint64_t last_tile_key;
+	struct stock_tile *last_tile;
+
+	double radius_at_depth(double Z);
+	struct stock_tile *stock_find_tile(int x, int y, bool create);
+	double stock_height(int x, int y);
+	void record_motion_XYZ(double fX, double fY, double fZ, double tX, double tY, double tZ);
+	double point_load(double X, double Y, double Z);
+	double area_load(double X1, double Y1, double Z1, double X2, double Y2, double Z2, double *lout);
+	bool link_is_clear(double X, double Y);
+	double stock_top_along(double X, double Y);
+	void retract_to(double Z);
+	void rapid_down_to(double Z);
+
+	void write_out(const char *data, unsigned int len);
+	void flush(void);
+	void out_reserve(unsigned int len);
+	void out_char(char c);
+	void out_str(const char *str);
+	void out_printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+	void out_int(char word, int value);
+	void out_coord(char word, double X);
 
-	double minX, maxX, minY, maxY;
+	void emit_G1(const struct gmove *from, const struct gmove *to);
+	int fit_arc(const struct gmove *start, unsigned int first, unsigned int count, double *cx, double *cy);
+	int fit_line(const struct gmove *start, unsigned int first, unsigned int count);
+	void flush_moves(void);
+	void queue_G1(double X, double Y, double Z, double F);
 };
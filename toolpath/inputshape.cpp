@@ -5,13 +5,25 @@
  *
  * SPDX-License-Identifier: GPL-3.0
  */
+#include <mutex>
+#include <type_traits>
+
 #include "tool.h"
 
 #include "endmill.h"
+#include "gcode.h"
+#include "parallel.h"
+#include "offset.h"
 
 /* todo: get rid of this addiction to print.h */
 #include "print.h"
 
+/*
+ * in streaming mode the planner thread adds tooldepths while the writer is
+ * walking the list for an earlier tool
+ */
+static std::mutex tooldepths_lock;
+
 static inline double dist(double X0, double Y0, double X1, double Y1)
 {
   return sqrt((X1-X0)*(X1-X0) + (Y1-Y0)*(Y1-Y0));
@@ -70,8 +82,11 @@ void inputshape::print_as_svg(void)
 #if 1
     for (auto i : skeleton)
         print_straight_skeleton(*i);
-    if (iss)
-        print_straight_skeleton(*iss);
+    if (extractor)
+        extractor->for_each_halfedge([](double X1, double Y1, double X2, double Y2, bool inner_bisector, bool bisector) {
+            if (bisector)
+                svg_line(X2, Y2, X1, Y1, inner_bisector ? "green" : "orange", inner_bisector ? 0.15 : 0.04);
+        });
 #endif
     for (auto i : children)
         i->print_as_svg();
@@ -81,18 +96,48 @@ void inputshape::print_as_svg(void)
 
 }
 
-void inputshape::output_gcode(int tool)
+void inputshape::output_gcode(class gcode_writer *gcode, int tool)
 {
     tool = abs(tool);
-    gcode_write_comment("Shape");
-    for (auto i =  tooldepths.rbegin(); i != tooldepths.rend(); ++i) {
+    vector<class tooldepth*> depths = get_tooldepths();
+
+    gcode->write_comment("Shape");
+    for (auto i =  depths.rbegin(); i != depths.rend(); ++i) {
         if ((*i)->toolnr == tool || tool == 0)
-            (*i)->output_gcode();
+            (*i)->output_gcode(gcode);
     }
         
     for (auto i : children)
-        i->output_gcode(tool);
+        i->output_gcode(gcode, tool);
+}
+
+/* does output_gcode() for <tool> cut anything */
+bool inputshape::has_work(int tool)
+{
+    tool = abs(tool);
+    for (auto i : get_tooldepths())
+        if ((i->toolnr == tool || tool == 0) && i->toollevels.size() > 0)
+            return true;
+    for (auto i : children)
+        if (i->has_work(tool))
+            return true;
+    return false;
+}
+
+vector<class tooldepth*> inputshape::get_tooldepths(void)
+{
+    std::lock_guard<std::mutex> lock(tooldepths_lock);
+    return tooldepths;
 }
+
+/* hands <td> to the writer, so only call this once all its toollevels are in */
+void inputshape::add_tooldepth(class tooldepth *td, int toolnr)
+{
+    std::lock_guard<std::mutex> lock(tooldepths_lock);
+    td->toolnr = toolnr;
+    tooldepths.push_back(td);
+}
+
 void inputshape::add_point(double X, double Y)
 {
     if (poly.size() > 0) {
@@ -146,9 +191,266 @@ bool inputshape::fits_inside(class inputshape *shape)
 }
 
 
+/*
+ * Offset the skeleton at <inset>. Insets that sit on a skeleton event get
+ * moved off it before CGAL ever sees them, so CGAL throwing is the
+ * exception rather than the rule; should it still happen, the inset is
+ * nudged a bounded number of times. Returns false if CGAL kept throwing or
+ * the polygons it came up with are not valid.
+ */
+#define OFFSET_RETRIES 8
+
+static bool offset_skeleton(const offset_extractor *extractor, double *inset, struct offset_recoveries *rec, PolygonWithHolesPtrVector *polygons)
+{
+    double safe = extractor->safe_inset(*inset);
+
+    if (safe != *inset)
+        rec->nudged++;
+    *inset = safe;
+
+    for (int i = 0; i < OFFSET_RETRIES; i++) {
+        try {
+            *polygons = extractor->offset(*inset);
+            return offsets_are_valid(*polygons);
+        } catch (...) { };
+        rec->retries++;
+        *inset = extractor->safe_inset(*inset + 0.00001);
+    }
+    polygons->clear();
+    return false;
+}
+
+/*
+ * Redo the skeleton of this shape in the exact kernel and use that for the
+ * rest of its offsets; the ones made so far came out fine and stay cached.
+ */
+bool inputshape::use_exact_kernel(void)
+{
+    class offset_extractor *exact;
+
+    /* in the FINE build everything is exact already */
+    if (recoveries.exact || std::is_same<K, KE>::value)
+        return false;
+    recoveries.exact = 1;
+
+    exact = offset_extractor::create(*polyhole, true);
+    if (!exact)
+        return false;
+    vprintf("Shape %s: redoing the skeleton in the exact kernel\n", name);
+    delete extractor;
+    extractor = exact;
+    return true;
+}
+
+/*
+ * *failed tells a failed offset apart from an inset with nothing left at it;
+ * the material at a failed inset may be left uncut, so that gets reported
+ * even when not verbose.
+ */
+PolygonWithHolesPtrVector inputshape::offset_robust(int toolnr, double *inset, bool *failed)
+{
+    PolygonWithHolesPtrVector polygons;
+    double requested = *inset;
+
+    *failed = false;
+    if (offset_skeleton(extractor, inset, &recoveries, &polygons))
+        return polygons;
+    if (use_exact_kernel()) {
+        *inset = requested;
+        if (offset_skeleton(extractor, inset, &recoveries, &polygons))
+            return polygons;
+    }
+    recoveries.failed++;
+    if (polygons.size() > 0)
+        return polygons;
+    *failed = true;
+    qprintf("Tool %i, shape %s: cannot offset at %5.4f mm, the material there may be left uncut\n", toolnr, name, requested);
+    return polygons;
+}
+
+/*
+ * The insets come from adding up stepovers, so the same one can differ in the
+ * last bits between passes; the cache goes by the inset rounded to a nanometer.
+ */
+static inline long long inset_key(double inset)
+{
+    return llround(inset * 1e6);
+}
+
+/*
+ * The skeleton and thus the offsets don't depend on the depth, so every
+ * depth pass after the first gets them from the cache.
+ */
+PolygonWithHolesPtrVector inputshape::offsets_at(int toolnr, double *inset, bool *failed)
+{
+    PolygonWithHolesPtrVector offset_polygons;
+    double requested = *inset;
+
+    auto cached = offset_cache.find(inset_key(requested));
+    if (cached != offset_cache.end()) {
+        *inset = cached->second.inset;
+        *failed = cached->second.failed;
+        return cached->second.polygons;
+    }
+
+    /* past the last skeleton vertex there is nothing left to offset */
+    *failed = false;
+    if (extractor && *inset < extractor->max_inset())
+        offset_polygons = offset_robust(toolnr, inset, failed);
+    offset_cache[inset_key(requested)] = {*inset, offset_polygons, *failed};
+    return offset_polygons;
+}
+
+/*
+ * Work out all insets the loop in create_toolpaths() is going to ask for,
+ * up to the last one the skeleton has anything for, and extract them in
+ * one sweep over the skeleton. With idle threads around, the insets are
+ * split into runs that are swept at the same time.
+ *
+ * Should an inset get nudged off a skeleton vertex, the ones after it are
+ * asked for at a slightly different inset and simply miss the cache; an
+ * inset the sweep could not trace is left to CGAL.
+ */
+void inputshape::prefetch_offsets(double inset, int step, double stepover, int want_optional, double end_inset)
+{
+    vector<double> insets;
+    unsigned int runs = 1 + parallel_idle();
+
+    if (!extractor || stepover <= 0)
+        return;
+    if (offset_cache.find(inset_key(inset)) != offset_cache.end())
+        return;
+
+    while (inset < extractor->max_inset()) {
+        insets.push_back(inset);
+        if (step == 0 || want_optional)
+            inset += stepover / 2;
+        else
+            inset += stepover;
+        if (inset > end_inset)
+            break;
+        step++;
+    }
+    if (insets.size() == 0)
+        return;
+
+    if (runs > insets.size())
+        runs = insets.size();
+    vector<vector<double>> run_insets(runs);
+    vector<vector<PolygonWithHolesPtrVector>> run_out(runs);
+    vector<vector<bool>> run_ok(runs);
+
+    for (unsigned int i = 0; i < insets.size(); i++)
+        run_insets[i * runs / insets.size()].push_back(insets[i]);
+
+    parallel_for(runs, [&](unsigned int r) {
+        extractor->extract(run_insets[r], run_out[r], run_ok[r]);
+    });
+
+    unsigned int i = 0;
+    for (unsigned int r = 0; r < runs; r++)
+        for (unsigned int j = 0; j < run_insets[r].size(); j++, i++) {
+            if (!run_ok[r][j]) {
+                vprintf("Offset sweep failed at inset %5.4f, using CGAL\n", insets[i]);
+                continue;
+            }
+            if (run_insets[r][j] != insets[i])
+                recoveries.nudged++;
+            offset_cache[inset_key(insets[i])] = {run_insets[r][j], run_out[r][j], false};
+        }
+}
+
+/* shapes (with their holes) too small to hold any toolpath */
+bool inputshape::is_null_shape(void)
+{
+    double mainarea = poly.area();
+
+    for (auto i : children)
+        mainarea += i->poly.area();
+    return mainarea < 0.1;
+}
+
+/*
+ * SVG input is full of vertices that (nearly) coincide with their neighbour
+ * or sit exactly on the line between their neighbours. Each of them is a
+ * zero length edge or a pair of events at the same time for the skeleton,
+ * which is where CGAL gets into trouble. Snap the points to a fine grid and
+ * drop those vertices; the outline moves by a fraction of a micron at most.
+ * Returns the number of vertices dropped.
+ */
+#define SNAP_GRID 10000000.0
+
+static unsigned int snap_polygon(const Polygon_2 &in, Polygon_2 *out)
+{
+    vector<Point> points;
+    unsigned int i;
+
+    for (auto v = in.vertices_begin(); v != in.vertices_end(); ++v) {
+        Point p(round(CGAL::to_double(v->x()) * SNAP_GRID) / SNAP_GRID, round(CGAL::to_double(v->y()) * SNAP_GRID) / SNAP_GRID);
+        if (points.size() > 0 && points.back() == p)
+            continue;
+        points.push_back(p);
+    }
+    while (points.size() > 1 && points.back() == points.front())
+        points.pop_back();
+
+    /* dropping one vertex can make its neighbour collinear in turn */
+    i = 0;
+    while (points.size() > 3 && i < points.size()) {
+        unsigned int prev = (i + points.size() - 1) % points.size();
+        unsigned int next = (i + 1) % points.size();
+        if (CGAL::collinear(points[prev], points[i], points[next])) {
+            points.erase(points.begin() + i);
+            if (i > 0)
+                i--;
+            continue;
+        }
+        i++;
+    }
+
+    *out = Polygon_2(points.begin(), points.end());
+    if (out->size() < 3 || !out->is_simple() || out->orientation() != in.orientation()) {
+        *out = in;
+        return 0;
+    }
+    return in.size() - out->size();
+}
+
+/*
+ * Both the background stage scene::process_nesting() starts and the first
+ * create_toolpaths() of a shape need its skeleton; whichever thread gets
+ * there first builds it, the other one waits for it to be done.
+ */
+void inputshape::build_skeleton(void)
+{
+    std::call_once(skeleton_once, [this]() {
+        Polygon_2 p;
+
+        recoveries.snapped += snap_polygon(poly, &p);
+        polyhole = new PolygonWithHoles(p);
+        for (auto i : children) {
+            recoveries.snapped += snap_polygon(i->poly, &p);
+            polyhole->add_hole(p);
+        }
+        extractor = offset_extractor::create(*polyhole, false);
+        if (!extractor)
+            use_exact_kernel();
+    });
+}
+
+/* the inputs that needed extra work to offset, for finding out why a file is slow */
+void inputshape::print_recoveries(void)
+{
+    if (recoveries.snapped + recoveries.nudged + recoveries.retries + recoveries.failed + recoveries.exact == 0)
+        return;
+    vprintf("Shape %s: %u vertices snapped, %u insets moved off skeleton events, %u CGAL retries, %u insets failed%s\n",
+        name, recoveries.snapped, recoveries.nudged, recoveries.retries, recoveries.failed,
+        recoveries.exact ? ", exact kernel" : "");
+}
+
 void inputshape::create_toolpaths(int toolnr, double depth, int finish_pass, int want_optional, double start_inset, double end_inset, bool want_skeleton_path)
 {
-    int level = 0;
+    int level = 0, step = 0;
 	class endmill *mill;
     double diameter;
     double stepover;
@@ -168,34 +470,12 @@ void inputshape::create_toolpaths(int toolnr, double depth, int finish_pass, int
     
     
     
-    if (!polyhole) {
-		double mainarea;
-		mainarea = poly.area();
-        polyhole = new PolygonWithHoles(poly);
-        for (auto i : children) {
-			mainarea += i->poly.area();
-			polyhole->add_hole(i->poly);
-		}
-		if (mainarea < 0.1) {
-			printf("SKIPPING NULL SHAPE\n");
-			polyhole = NULL;
-			return;
-		}
-#if 0
-		static char filename[]="shapeA.svg";
-	  set_svg_bounding_box(0, 0, 100, 100);
-	  write_svg_header(filename, 1.0);
-
-	  print_as_svg();
-	  write_svg_footer();
-	  printf("SHape %s has depth %5.4f\n", filename, get_depth());
-	  filename[5]++;
-#endif
-    }
-    
-    if (!iss) {
-        iss =  CGAL::create_interior_straight_skeleton_2(*polyhole);
+    if (is_null_shape()) {
+        vprintf("Skipping null shape\n");
+        return;
     }
+
+    build_skeleton();
     
     /* first inset is the radius (half diameter) of the tool, after that increment by stepover */
     inset = start_inset + diameter/2;
@@ -210,17 +490,14 @@ void inputshape::create_toolpaths(int toolnr, double depth, int finish_pass, int
         stepover = stepover / sqrt(2);
         
     class tooldepth * td = new(class tooldepth);
-    tooldepths.push_back(td);
     td->depth = depth + z_offset;
-    td->toolnr = toolnr;
     td->diameter = diameter;
     td->run_reverse = reverse;
     
     do {
         class toollevel *tool = new(class toollevel);
         int added = 0;
-        int had_exception = 1;
-		int exceptioncount = 0;
+        bool failed;
         
         tool->level = level;
         tool->offset = inset;
@@ -231,26 +508,16 @@ void inputshape::create_toolpaths(int toolnr, double depth, int finish_pass, int
         tool->minY = minY;
         tool->name = "Pocketing";
         
-        if (want_optional && (level > 1) && ((level & 1) == 0))
+        if (want_optional && (step > 1) && ((step & 1) == 0))
             tool->is_optional = 1;
             
         PolygonWithHolesPtrVector  offset_polygons;
 //        offset_polygons = CGAL::create_interior_skeleton_and_offset_polygons_with_holes_2(inset, *polyhole);
 
-        while (had_exception) {
-            had_exception = 0;
-			if (exceptioncount > 5)
-                offset_polygons = arrange_offset_polygons_2(CGAL::create_offset_polygons_2<Polygon_2>(inset,*iss) );
-
-            try {
-                offset_polygons = arrange_offset_polygons_2(CGAL::create_offset_polygons_2<Polygon_2>(inset,*iss) );
-            } catch (...) { had_exception = 1; exceptioncount++;};
-            
-            if (had_exception)
-                inset = inset + 0.00001;
-        }
+        prefetch_offsets(inset, step, stepover, want_optional, end_inset);
+        offset_polygons = offsets_at(toolnr, &inset, &failed);
         
-        if (level == 0 && want_skeleton_path) {
+        if (step == 0 && want_skeleton_path) {
 			K k;
             for (auto ply : offset_polygons) {
                 SsPtr pp = CGAL::create_interior_straight_skeleton_2(ply->outer_boundary().vertices_begin(),
@@ -278,17 +545,25 @@ void inputshape::create_toolpaths(int toolnr, double depth, int finish_pass, int
               }
         }
         
-        if (!added)
+        /*
+         * a failed inset is not the end of the pocket; go on with the next
+         * one, but the levels only count the ones that made it
+         */
+        if (failed) {
+            delete tool;
+        } else {
+            if (!added)
                 break; /* fixme: memleak */
- 
-        td->toollevels.push_back(tool);       
-        if (level == 0 || want_optional)
+            td->toollevels.push_back(tool);
+            level ++;
+        }
+        if (step == 0 || want_optional)
             inset += stepover / 2;
         else
             inset += stepover;
         if (inset > end_inset)
             break;
-        level ++;
+        step ++;
         
     } while (1);
     if (skeleton.size() > 0 && want_skeleton_path) {
@@ -318,6 +593,7 @@ void inputshape::create_toolpaths(int toolnr, double depth, int finish_pass, int
             } 
         }
     }
+    add_tooldepth(td, toolnr);
 }
 
 void inputshape::create_toolpaths_cutout(int toolnr, double depth, bool finish_pass)
@@ -381,9 +657,7 @@ void inputshape::create_toolpaths_cutout(int toolnr, double depth, bool finish_p
 						next = 0;
 
 					class tooldepth * td = new(class tooldepth);
-					tooldepths.push_back(td);
 					td->depth = currentdepth;
-					td->toolnr = toolnr;
 					td->diameter = mill->get_diameter();
 					class toollevel *tool = new(class toollevel);
 					tool->level = 0;
@@ -405,6 +679,7 @@ void inputshape::create_toolpaths_cutout(int toolnr, double depth, bool finish_p
 					p2->push_back(Point(CGAL::to_double((*p)[i].x()), CGAL::to_double((*p)[i].y())));
 					p2->push_back(Point(CGAL::to_double((*p)[next].x()), CGAL::to_double((*p)[next].y())));
 					tool->add_poly_vcarve(p2, d1, d1 + d2);
+					add_tooldepth(td, toolnr);
 					
 				}
 	        }
@@ -457,9 +732,7 @@ void inputshape::create_toolpaths_cutout(int toolnr, double depth, bool finish_p
 						break;
 
 					class tooldepth * td = new(class tooldepth);
-					tooldepths.push_back(td);
 					td->depth = currentdepth;
-					td->toolnr = toolnr;
 					td->diameter = mill->get_diameter();
 					class toollevel *tool = new(class toollevel);
 					tool->level = 0;
@@ -481,6 +754,7 @@ void inputshape::create_toolpaths_cutout(int toolnr, double depth, bool finish_p
 					p2->push_back(Point(CGAL::to_double((*p)[i].x()), CGAL::to_double((*p)[i].y())));
 					p2->push_back(Point(CGAL::to_double((*p)[next].x()), CGAL::to_double((*p)[next].y())));
 					tool->add_poly_vcarve(p2, d1, d1 + d2);
+					add_tooldepth(td, toolnr);
 					currentdepth += d2;
 					
 				}
@@ -728,17 +1002,9 @@ static void process_vcarve(class toollevel *tool, double X1, double Y1, double X
 void inputshape::create_toolpaths_vcarve(int toolnr, double maxdepth, double stock_to_leave)
 {
 	class endmill *mill = get_endmill(toolnr);
-    if (!polyhole) {
-        polyhole = new PolygonWithHoles(poly);
-        for (auto i : children)
-          polyhole->add_hole(i->poly);
-    }
-    
 //    printf("VCarve toolpath\n");
     
-    if (!iss) {
-        iss =  CGAL::create_interior_straight_skeleton_2(*polyhole);
-    }
+    build_skeleton();
     
 
 	do {
@@ -747,9 +1013,7 @@ void inputshape::create_toolpaths_vcarve(int toolnr, double maxdepth, double sto
 
 		diameter = mill->distance_of_geometry(maxdepth);
 
-	    tooldepths.push_back(td);
 		td->depth = maxdepth + z_offset;
-		td->toolnr = toolnr;
 	    td->diameter = diameter;
 	    td->run_reverse = false;
     
@@ -766,16 +1030,9 @@ void inputshape::create_toolpaths_vcarve(int toolnr, double maxdepth, double sto
         
         PolygonWithHolesPtrVector  offset_polygons;
 
-		bool had_exception = true;
-        while (had_exception) {
-            had_exception = false;
-            try {
-                offset_polygons = arrange_offset_polygons_2(CGAL::create_offset_polygons_2<Polygon_2>(diameter,*iss) );
-            } catch (...) { had_exception = true;};
-            
-            if (had_exception)
-                diameter = diameter + 0.00001;
-        }
+        bool failed;
+        if (extractor)
+            offset_polygons = offset_robust(toolnr, &diameter, &failed);
         
         for (auto ply : offset_polygons) {        
             Polygon_2 *p;
@@ -807,13 +1064,12 @@ void inputshape::create_toolpaths_vcarve(int toolnr, double maxdepth, double sto
               }
         }
         td->toollevels.push_back(tool);       
+	    add_tooldepth(td, toolnr);
 	} while (0);
 
 
 
     class tooldepth * td = new(class tooldepth);
-    tooldepths.push_back(td);
-    td->toolnr = toolnr;
     
     class toollevel *tool = new(class toollevel);       
     tool->name = "VCarve path";
@@ -821,24 +1077,25 @@ void inputshape::create_toolpaths_vcarve(int toolnr, double maxdepth, double sto
     tool->minY = minY;
     td->toollevels.push_back(tool);
     
-    for (auto x = iss->halfedges_begin(); x != iss->halfedges_end(); ++x) {
-            double X1, Y1, X2, Y2;
-            X1 = point_snap2(CGAL::to_double(x->vertex()->point().x()));
-            Y1 = point_snap2(CGAL::to_double(x->vertex()->point().y()));
-            
-            X2 = point_snap2(CGAL::to_double(x->opposite()->vertex()->point().x()));
-            Y2 = point_snap2(CGAL::to_double(x->opposite()->vertex()->point().y()));
-            
-			process_vcarve(tool, X1, Y1, X2, Y2, x->is_inner_bisector(), x->is_bisector(), mill, parent, maxdepth, this, z_offset + stock_to_leave);
-    }
+    if (extractor)
+        extractor->for_each_halfedge([&](double X1, double Y1, double X2, double Y2, bool inner_bisector, bool bisector) {
+			process_vcarve(tool, point_snap2(X1), point_snap2(Y1), point_snap2(X2), point_snap2(Y2), inner_bisector, bisector, mill, parent, maxdepth, this, z_offset + stock_to_leave);
+        });
+    add_tooldepth(td, toolnr);
 }
 
-void inputshape::consolidate_toolpaths(bool want_inbetween_paths)
+/* toolnr 0 consolidates the toolpaths of all tools */
+void inputshape::consolidate_toolpaths(bool want_inbetween_paths, int toolnr)
 {
     unsigned int level;
+    vector<class tooldepth*> depths;
+
+    for (auto td : get_tooldepths())
+        if (td->toolnr == abs(toolnr) || toolnr == 0)
+            depths.push_back(td);
 
     if (want_inbetween_paths) {  
-      for (auto td : tooldepths) {  
+      for (auto td : depths) {  
         /* step 1 : eliminate redundant optional paths */	
         /* first for not holes */
         for (level = 0; level + 1 < td->toollevels.size(); level++) {
@@ -913,7 +1170,7 @@ void inputshape::consolidate_toolpaths(bool want_inbetween_paths)
       }
     }
     /* step 3 : consolidate outer "rings" into inner rings */
-   for (auto td : tooldepths) {  
+   for (auto td : depths) {  
      for (level = 0; level + 1 < td->toollevels.size(); level++) {
         for (auto tp : td->toollevels[level]->toolpaths) {
             class toolpath *match = NULL;
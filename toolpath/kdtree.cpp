@@ -0,0 +1,277 @@
+/*
+ * (C) Copyright 2019  -  Arjan van de Ven <arjanvandeven@gmail.com>
+ *
+ * This file is part of FenrusCNCtools
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "kdtree.h"
+
+kdtree::kdtree(const std::vector<struct kd_point> &_points, const std::vector<double> &_depth, const std::vector<double> &_prio)
+{
+	points = _points;
+	depth = _depth;
+	prio = _prio;
+	item_alive.assign(depth.size(), 1);
+	item_leaves.resize(depth.size());
+
+	if (points.size() > 0)
+		build(0, points.size(), -1);
+}
+
+int kdtree::build(int lo, int hi, int parent)
+{
+	struct kd_node node;
+	int i, n;
+
+	node.minX = node.maxX = points[lo].X;
+	node.minY = node.maxY = points[lo].Y;
+	for (i = lo + 1; i < hi; i++) {
+		node.minX = fmin(node.minX, points[i].X);
+		node.maxX = fmax(node.maxX, points[i].X);
+		node.minY = fmin(node.minY, points[i].Y);
+		node.maxY = fmax(node.maxY, points[i].Y);
+	}
+	node.lo = lo;
+	node.hi = hi;
+	node.left = -1;
+	node.right = -1;
+	node.parent = parent;
+
+	n = nodes.size();
+	nodes.push_back(node);
+
+	if (hi - lo > KD_BUCKET) {
+		int mid = (lo + hi) / 2;
+		bool splitX = (node.maxX - node.minX) >= (node.maxY - node.minY);
+		int l, r;
+
+		std::nth_element(points.begin() + lo, points.begin() + mid, points.begin() + hi,
+			[splitX](const struct kd_point &A, const struct kd_point &B) {
+				return splitX ? A.X < B.X : A.Y < B.Y;
+			});
+
+		l = build(lo, mid, n);
+		r = build(mid, hi, n);
+		/* nodes[] may have been reallocated by the recursion */
+		nodes[n].left = l;
+		nodes[n].right = r;
+	} else {
+		for (i = lo; i < hi; i++) {
+			std::vector<int> &leaves = item_leaves[points[i].item];
+			if (leaves.size() == 0 || leaves.back() != n)
+				leaves.push_back(n);
+		}
+	}
+	update(n);
+	return n;
+}
+
+/* recompute the aggregates of one node from its points or children */
+void kdtree::update(int n)
+{
+	struct kd_node *node = &nodes[n];
+
+	node->alive = 0;
+	node->max_depth = -INFINITY;
+	node->min_prio = INFINITY;
+	node->max_prio = -INFINITY;
+
+	if (node->left < 0) {
+		for (int i = node->lo; i < node->hi; i++) {
+			int item = points[i].item;
+			if (!item_alive[item])
+				continue;
+			node->alive++;
+			node->max_depth = fmax(node->max_depth, depth[item]);
+			node->min_prio = fmin(node->min_prio, prio[item]);
+			node->max_prio = fmax(node->max_prio, prio[item]);
+		}
+		return;
+	}
+
+	for (int c : {node->left, node->right}) {
+		struct kd_node *child = &nodes[c];
+		if (child->alive == 0)
+			continue;
+		node->alive += child->alive;
+		node->max_depth = fmax(node->max_depth, child->max_depth);
+		node->min_prio = fmin(node->min_prio, child->min_prio);
+		node->max_prio = fmax(node->max_prio, child->max_prio);
+	}
+}
+
+void kdtree::set_alive(int item, bool alive)
+{
+	if ((bool)item_alive[item] == alive)
+		return;
+	item_alive[item] = alive;
+
+	for (int n : item_leaves[item]) {
+		while (n >= 0) {
+			update(n);
+			n = nodes[n].parent;
+		}
+	}
+}
+
+void kdtree::remove(int item)
+{
+	set_alive(item, false);
+}
+
+void kdtree::restore(int item)
+{
+	set_alive(item, true);
+}
+
+/* squared distance from a point to the bounding box of a node */
+static inline double box_dist2(const struct kd_node *node, double X, double Y)
+{
+	double dx = 0, dy = 0;
+
+	if (X < node->minX)
+		dx = node->minX - X;
+	else if (X > node->maxX)
+		dx = X - node->maxX;
+	if (Y < node->minY)
+		dy = node->minY - Y;
+	else if (Y > node->maxY)
+		dy = Y - node->maxY;
+	return dx * dx + dy * dy;
+}
+
+static inline double point_dist2(const struct kd_point *p, double X, double Y)
+{
+	return (p->X - X) * (p->X - X) + (p->Y - Y) * (p->Y - Y);
+}
+
+void kdtree::items_within_node(int n, double X, double Y, double r2, std::vector<int> &out)
+{
+	struct kd_node *node = &nodes[n];
+
+	if (node->alive == 0 || box_dist2(node, X, Y) > r2)
+		return;
+
+	if (node->left >= 0) {
+		items_within_node(node->left, X, Y, r2, out);
+		items_within_node(node->right, X, Y, r2, out);
+		return;
+	}
+
+	for (int i = node->lo; i < node->hi; i++) {
+		int item = points[i].item;
+		if (!item_alive[item] || point_dist2(&points[i], X, Y) > r2)
+			continue;
+		if (std::find(out.begin(), out.end(), item) == out.end())
+			out.push_back(item);
+	}
+}
+
+void kdtree::items_within(double X, double Y, double radius, std::vector<int> &out)
+{
+	out.clear();
+	if (nodes.size() > 0)
+		items_within_node(0, X, Y, radius * radius, out);
+}
+
+void kdtree::top_depth_node(int n, const std::vector<char> &skip, double *best, bool *found)
+{
+	struct kd_node *node = &nodes[n];
+
+	if (node->alive == 0)
+		return;
+	if (*found && node->max_depth <= *best)
+		return;
+
+	if (node->left >= 0) {
+		/* look at the more promising side first so the other one gets pruned */
+		int first = node->left, second = node->right;
+		if (nodes[second].max_depth > nodes[first].max_depth)
+			std::swap(first, second);
+		top_depth_node(first, skip, best, found);
+		top_depth_node(second, skip, best, found);
+		return;
+	}
+
+	for (int i = node->lo; i < node->hi; i++) {
+		int item = points[i].item;
+		if (!item_alive[item] || skip[item])
+			continue;
+		if (!*found || depth[item] > *best) {
+			*best = depth[item];
+			*found = true;
+		}
+	}
+}
+
+bool kdtree::top_depth(const std::vector<char> &skip, double *_depth)
+{
+	bool found = false;
+	double best = 0;
+
+	if (nodes.size() > 0)
+		top_depth_node(0, skip, &best, &found);
+	if (found)
+		*_depth = best;
+	return found;
+}
+
+void kdtree::nearest_node(int n, double X, double Y, double _prio, double min_depth, const std::vector<char> &near, double near2, double *best2, int *best, double *pX, double *pY)
+{
+	struct kd_node *node = &nodes[n];
+	double d2;
+
+	if (node->alive == 0)
+		return;
+	if (_prio < node->min_prio || _prio > node->max_prio)
+		return;
+	d2 = box_dist2(node, X, Y);
+	if (d2 > *best2)
+		return;
+	/* too deep for this pass and too far away to hold one of the near items */
+	if (node->max_depth < min_depth && d2 > near2)
+		return;
+
+	if (node->left >= 0) {
+		int first = node->left, second = node->right;
+		if (box_dist2(&nodes[second], X, Y) < box_dist2(&nodes[first], X, Y))
+			std::swap(first, second);
+		nearest_node(first, X, Y, _prio, min_depth, near, near2, best2, best, pX, pY);
+		nearest_node(second, X, Y, _prio, min_depth, near, near2, best2, best, pX, pY);
+		return;
+	}
+
+	for (int i = node->lo; i < node->hi; i++) {
+		int item = points[i].item;
+		if (!item_alive[item] || prio[item] != _prio)
+			continue;
+		if (depth[item] < min_depth && !near[item])
+			continue;
+		d2 = point_dist2(&points[i], X, Y);
+		if (d2 < *best2 || (d2 == *best2 && item < *best)) {
+			*best2 = d2;
+			*best = item;
+			*pX = points[i].X;
+			*pY = points[i].Y;
+		}
+	}
+}
+
+int kdtree::nearest(double X, double Y, double _prio, double min_depth, const std::vector<char> &near, double near_radius, double *dist, double *pX, double *pY)
+{
+	double best2 = INFINITY;
+	int best = -1;
+
+	if (nodes.size() > 0)
+		nearest_node(0, X, Y, _prio, min_depth, near, near_radius * near_radius, &best2, &best, pX, pY);
+	if (best >= 0 && dist)
+		*dist = sqrt(best2);
+	return best;
+}
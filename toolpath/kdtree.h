@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+
+/*
+ * k-d tree over the points toolpaths can be entered at, for picking the next
+ * toolpath to cut. Every point belongs to an item (a toolpath) with a depth
+ * and a priority; items get removed as they are cut, and each node keeps the
+ * depth/priority range of what is still left below it so that the filtered
+ * queries toollevel::output_gcode() needs can skip whole subtrees.
+ */
+#define KD_BUCKET 8
+
+struct kd_point {
+	double X, Y;
+	int item;
+};
+
+struct kd_node {
+	double minX, minY, maxX, maxY;	/* bounding box of all points, dead or alive */
+	int lo, hi;			/* range in points[] */
+	int left, right, parent;	/* -1 for none */
+	int alive;
+	double max_depth;
+	double min_prio, max_prio;
+};
+
+class kdtree {
+public:
+	kdtree(const std::vector<struct kd_point> &_points, const std::vector<double> &_depth, const std::vector<double> &_prio);
+
+	void remove(int item);
+	void restore(int item);
+	bool is_alive(int item) { return item_alive[item]; };
+
+	/* all live items with a point within <radius> */
+	void items_within(double X, double Y, double radius, std::vector<int> &out);
+
+	/* deepest (highest) depth of live items, skipping the items marked in <skip> */
+	bool top_depth(const std::vector<char> &skip, double *depth);
+
+	/*
+	 * nearest live item of priority <prio> that is either at least as high as
+	 * <min_depth> or marked in <near> (all of which have a point within
+	 * <near_radius>); returns -1 if there is none
+	 */
+	int nearest(double X, double Y, double prio, double min_depth, const std::vector<char> &near, double near_radius, double *dist, double *pX, double *pY);
+
+private:
+	std::vector<struct kd_point> points;
+	std::vector<struct kd_node> nodes;
+	std::vector<double> depth;
+	std::vector<double> prio;
+	std::vector<char> item_alive;
+	std::vector<std::vector<int>> item_leaves;
+
+	int build(int lo, int hi, int parent);
+	void update(int node);
+	void set_alive(int item, bool alive);
+	void items_within_node(int n, double X, double Y, double r2, std::vector<int> &out);
+	void top_depth_node(int n, const std::vector<char> &skip, double *best, bool *found);
+	void nearest_node(int n, double X, double Y, double prio, double min_depth, const std::vector<char> &near, double near2, double *best2, int *best, double *pX, double *pY);
+};
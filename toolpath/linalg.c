@@ -246,8 +246,6 @@ int lines_tangent_to_two_circles(double X1, double Y1, double R1, double X2, dou
      return 0;
 }
 
-extern void gcode_write_comment(const char *comment);
-
 
 int vector_intersects_vector(double X1, double Y1, double X2, double Y2, double X3, double Y3, double X4, double Y4, double *pX, double *pY)
 {
@@ -284,16 +282,12 @@ int vector_intersects_vector(double X1, double Y1, double X2, double Y2, double
               k = (X1 + l * x2 - X3) / x4;
               *pX = X1 + l * x2;
               *pY = Y1 + l * y2;
+			  /* not stdout, that may be carrying the G-code (--stream -) */
 			  if (verbose) {
-					char buffer[256];
-					sprintf(buffer, "l is %5.5f k is %5.5f  l1 %5.5f  l2 %5.5f", l, k, l1, l2);
-					gcode_write_comment(buffer);
-					sprintf(buffer, "X1,Y1  %5.2f,%5.2f->%5.2f,%5.2f", X1, Y1, X2, Y2);
-					gcode_write_comment(buffer);
-					sprintf(buffer, "X3,Y3  %5.2f,%5.2f->%5.2f,%5.2f", X3, Y3, X4, Y4);
-					gcode_write_comment(buffer);
-					sprintf(buffer, "pX,pY  %5.2f,%5.2f", *pX, *pY);
-					gcode_write_comment(buffer);
+					fprintf(stderr, "l is %5.5f k is %5.5f  l1 %5.5f  l2 %5.5f\n", l, k, l1, l2);
+					fprintf(stderr, "X1,Y1  %5.2f,%5.2f->%5.2f,%5.2f\n", X1, Y1, X2, Y2);
+					fprintf(stderr, "X3,Y3  %5.2f,%5.2f->%5.2f,%5.2f\n", X3, Y3, X4, Y4);
+					fprintf(stderr, "pX,pY  %5.2f,%5.2f\n", *pX, *pY);
 			  }
 
               if (l < 0 || l > 1)
@@ -14,6 +14,7 @@
 
 extern "C" {
     #include "toolpath.h"
+    #include "fenrus.h"
 }
 
 int verbose = 0;
@@ -21,6 +22,9 @@ int quiet = 0;
 
 static int stl_flip = 0;
 static int direct = 0;
+static const char *stream_to = NULL;
+static const char *save_plan_to = NULL;
+static int emit = 0;
 
 double option_to_double_mm(char *str, bool metric_default)
 {
@@ -59,6 +63,22 @@ void usage(void)
 	printf("\t--Yflip				(-Y)	Show STL model from the front instead of the top\n");
 	printf("\t--Xflip				(-X)	Show STL model from the side instead of the top\n");
 	printf("\t--stlZoffset <pct>	(-Z)	Drop <pct> amount from the bottom of the STL model\n");
+	printf("\t--heightmap <mm>	(-H)	Sample the STL model into a 16 bit heightmap with <mm> resolution\n");
+	printf("\t--arc-tolerance <mm>	(-A)	Fit G2/G3 arcs to the toolpath within <mm>\n");
+	printf("\t--merge-tolerance <mm>	(-M)	Merge G1 moves that are collinear within <mm>\n");
+	printf("\t--dialect <name>	(-G)	write G-code for grbl, linuxcnc or carbide (motion)\n");
+	printf("\t--line-numbers		(-N)	number the G-code blocks\n");
+	printf("\t--stay-down			(-k)	link toolpaths at depth through already cleared stock\n");
+	printf("\t--low-rapids <mm>	(-R)	rapid <mm> above the remaining stock instead of at the retract height\n");
+	printf("\t--pocket-order <order> (-P)	cut shapes depth first, level first or pick the faster (auto)\n");
+	printf("\t--two-opt <ms>		(-T)	spend up to <ms> per toolpath level shortening the travel between paths\n");
+	printf("\t--estimate[=<a>,<jd>,<rapid>] (-E)	estimate the cycle time with <a> mm/s^2 acceleration,\n");
+	printf("\t					<jd> mm junction deviation and <rapid> mm/min rapids (400,0.01,5000)\n");
+	printf("\t--save-plan <file>	(-w)	also save the planned toolpaths to <file>, e.g. design.plan\n");
+	printf("\t					(with --stream, all planning is done before writing starts)\n");
+	printf("\t--emit				(-m)	the input files are saved plans: only order and write the G-code\n");
+	printf("\t--stream <file>		(-S)	write G-code to <file> (- for stdout); for SVG while later tools are still being planned\n");
+	printf("\t--jobs <n>			(-j)	plan the toolpaths of <n> shapes at the same time (default: one per CPU)\n");
 	printf("\t--direct			 	(-O)	Force direct toolpath mode\n");
 	printf("\t--quiet				(-q)	suppress non-error prints\n");
 	exit(EXIT_SUCCESS);
@@ -87,6 +107,20 @@ static struct option long_options[] =
 		  {"Yfront",	required_argument, 0, 'Y'},
 		  {"Xfront",	required_argument, 0, 'X'},
 		  {"stlZoffset",	required_argument, 0, 'Z'},
+		  {"heightmap",	required_argument, 0, 'H'},
+		  {"arc-tolerance",	required_argument, 0, 'A'},
+		  {"merge-tolerance",	required_argument, 0, 'M'},
+		  {"stream",	required_argument, 0, 'S'},
+		  {"dialect",	required_argument, 0, 'G'},
+		  {"line-numbers",	no_argument, 0, 'N'},
+		  {"estimate",	optional_argument, 0, 'E'},
+		  {"stay-down",	no_argument, 0, 'k'},
+		  {"low-rapids",	required_argument, 0, 'R'},
+		  {"two-opt",	required_argument, 0, 'T'},
+		  {"pocket-order",	required_argument, 0, 'P'},
+		  {"save-plan",	required_argument, 0, 'w'},
+		  {"emit",	no_argument, 0, 'm'},
+		  {"jobs",	required_argument, 0, 'j'},
           {0, 0, 0, 0}
         };
 
@@ -104,7 +138,7 @@ int main(int argc, char **argv)
     
     scene->set_depth(inch_to_mm(0.044));
 
-    while ((opt = getopt_long(argc, argv, "Oqavfsil:t:d:D:xhYXc:o:Z:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "Oqavfsil:t:d:D:xhYXc:o:Z:H:A:M:S:G:NE::kR:T:P:w:mj:", long_options, &option_index)) != -1) {
         switch (opt)
 		{
 			case 'v':
@@ -170,6 +204,61 @@ int main(int argc, char **argv)
 			case 'Z':
 				scene->set_z_offset(0.01  * strtod(optarg, NULL) * fmax(scene->get_cutout_depth(), scene->get_depth()) );
 				break;
+			case 'H': /* mm */
+				set_heightmap_resolution(option_to_double_mm(optarg, true));
+				qprintf("Heightmap resolution set to %5.3fmm\n", option_to_double_mm(optarg, true));
+				break;
+			case 'A': /* mm */
+				gcode_set_arc_tolerance(option_to_double_mm(optarg, true));
+				qprintf("Arc fitting tolerance set to %5.3fmm\n", option_to_double_mm(optarg, true));
+				break;
+			case 'M': /* mm */
+				gcode_set_merge_tolerance(option_to_double_mm(optarg, true));
+				qprintf("Collinear merge tolerance set to %5.3fmm\n", option_to_double_mm(optarg, true));
+				break;
+			case 'S':
+				stream_to = optarg;
+				break;
+			case 'w':
+				save_plan_to = optarg;
+				break;
+			case 'm':
+				emit = 1;
+				break;
+			case 'j':
+				set_parallel_jobs(strtol(optarg, NULL, 10));
+				break;
+			case 'G':
+				if (gcode_set_dialect(optarg) < 0)
+					printf("Unknown controller dialect %s, use grbl, linuxcnc or carbide\n", optarg);
+				else
+					qprintf("Writing G-code for %s\n", optarg);
+				break;
+			case 'P':
+				if (scene_set_pocket_order(optarg) < 0)
+					printf("Unknown pocket order %s, use depth, level or auto\n", optarg);
+				break;
+			case 'N':
+				gcode_want_line_numbers();
+				break;
+			case 'k':
+				gcode_want_staydown();
+				break;
+			case 'R': /* mm */
+				gcode_set_low_rapids(option_to_double_mm(optarg, true));
+				qprintf("Rapids at %5.3fmm above the remaining stock\n", option_to_double_mm(optarg, true));
+				break;
+			case 'T': /* msec */
+				toollevel_set_two_opt_time(strtod(optarg, NULL));
+				qprintf("Spending up to %5.0fms per level on the toolpath order\n", strtod(optarg, NULL));
+				break;
+			case 'E': {
+				double accel = 400, jd = 0.01, rapid = 5000;
+				if (optarg)
+					sscanf(optarg, "%lf,%lf,%lf", &accel, &jd, &rapid);
+				gcode_want_estimate(accel, jd, rapid);
+				break;
+			}
 			case 't':
 				int arg;
 				arg = strtoull(optarg, NULL, 10);
@@ -196,11 +285,43 @@ int main(int argc, char **argv)
     set_retract_height_imperial(0.06);
     scene->set_default_tool(tool);
 
+    if (save_plan_to && emit) {
+		printf("--save-plan and --emit can't be used together: the plan would be saved back over itself\n");
+		return EXIT_FAILURE;
+    }
+    if (save_plan_to && argc - optind > 1) {
+		printf("--save-plan takes one input file, the plans of the others would overwrite it\n");
+		return EXIT_FAILURE;
+    }
+    if (stream_to && argc - optind > 1) {
+		printf("--stream takes one input file, the G-code of the others would overwrite it\n");
+		return EXIT_FAILURE;
+    }
+
+    if (stream_to && strcmp(stream_to, "-") == 0)
+		gcode_stream_to_stdout();
+
    for(; optind < argc; optind++) {      
-		char outputfile[81920], *c;
+		char outputfile[81920], *c, *base;
+		bool streamed = false;
 		strcpy(outputfile, argv[optind]);
 		c = outputfile;
-		if (strstr(argv[optind], ".csv") || direct) {
+		if (emit) {
+			if (!scene->load_plan(argv[optind]))
+				continue;
+			/* <name>.plan becomes <name>.nc; anything else just gets .nc added */
+			base = strrchr(outputfile, '/');
+			base = base ? base + 1 : outputfile;
+			c = outputfile + strlen(outputfile);
+			if (c - base > 5 && strcmp(c - 5, ".plan") == 0)
+				c -= 5;
+			sprintf(c, ".nc");
+			if (strcmp(outputfile, argv[optind]) == 0) {
+				printf("Not writing G-code over the plan %s\n", argv[optind]);
+				continue;
+			}
+			c = NULL;
+		} else if (strstr(argv[optind], ".csv") || direct) {
 			parse_csv_file(scene, argv[optind], tool);
 			c = strstr(outputfile, ".csv");
 			if (!c)
@@ -215,15 +336,32 @@ int main(int argc, char **argv)
 
 			scene->process_nesting();
 
-			scene->create_toolpaths();
+			/*
+			 * with --stream, planning happens while the gcode is being written;
+			 * writing trims the toolpaths, so a plan to save has to be finished first
+			 */
+			if (stream_to && !save_plan_to)
+				streamed = true;
+			else
+				scene->create_toolpaths();
 		}
 
 		if (c)
 			sprintf(c, ".nc");
 
-		if (verbose)		
-			scene->write_svg("output.svg");
-		scene->write_gcode(outputfile, "main design");
+		if (save_plan_to && !emit)
+			scene->save_plan(save_plan_to);
+
+		if (streamed) {
+			scene->write_gcode_streamed(stream_to, "main design");
+			if (verbose)
+				scene->write_svg("output.svg");
+		} else {
+			if (verbose)		
+				scene->write_svg("output.svg");
+			/* CSV, STL and plans are done planning by now; --stream only picks where the G-code goes */
+			scene->write_gcode(stream_to ? stream_to : outputfile, "main design");
+		}
 		if (scene->inlay_plug) {
 			if (verbose)
 				scene->inlay_plug->write_svg("inlay.svg");
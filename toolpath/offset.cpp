@@ -0,0 +1,262 @@
+/*
+ * (C) Copyright 2019  -  Arjan van de Ven <arjanvandeven@gmail.com>
+ *
+ * This file is part of FenrusCNCtools
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <algorithm>
+
+#include "offset.h"
+
+template <class Handle>
+static inline double vtime(Handle v)
+{
+	return CGAL::to_double(v->time());
+}
+
+template <class Kernel>
+kernel_offset_extractor<Kernel>::kernel_offset_extractor(boost::shared_ptr<Skeleton> _skeleton)
+{
+	skeleton = _skeleton;
+	max_time = 0;
+	max_id = 0;
+
+	for (auto v = skeleton->vertices_begin(); v != skeleton->vertices_end(); ++v) {
+		vertex_times.push_back(vtime(v));
+		max_time = fmax(max_time, vtime(v));
+	}
+	sort(vertex_times.begin(), vertex_times.end());
+
+	for (auto h = skeleton->halfedges_begin(); h != skeleton->halfedges_end(); ++h) {
+		double t0, t1;
+
+		max_id = max(max_id, (unsigned int)h->id());
+		if (!h->is_bisector())
+			continue;
+		t0 = vtime(h->opposite()->vertex());
+		t1 = vtime(h->vertex());
+		if (t0 >= t1)
+			continue;
+		edges.push_back({h, t0, t1});
+	}
+	sort(edges.begin(), edges.end(), [](const struct sweep_edge &A, const struct sweep_edge &B) {
+		if (A.t0 != B.t0)
+			return A.t0 < B.t0;
+		return A.h->id() < B.h->id();
+	});
+}
+
+/*
+ * The default kernel usually does fine; the shapes it gets wrong (CGAL
+ * failing to build the skeleton, or offsets that intersect themselves) are
+ * redone in the exact kernel, which is many times slower for everything.
+ */
+class offset_extractor *offset_extractor::create(const PolygonWithHoles &polyhole, bool exact)
+{
+	if (!exact) {
+		SsPtr skeleton = CGAL::create_interior_straight_skeleton_2(polyhole);
+		if (!skeleton)
+			return NULL;
+		return new kernel_offset_extractor<K>(skeleton);
+	}
+
+	CGAL::Polygon_2<KE> outer;
+	for (auto v = polyhole.outer_boundary().vertices_begin(); v != polyhole.outer_boundary().vertices_end(); ++v)
+		outer.push_back(KE::Point_2(CGAL::to_double(v->x()), CGAL::to_double(v->y())));
+	CGAL::Polygon_with_holes_2<KE> exact_polyhole(outer);
+	for (auto hi = polyhole.holes_begin(); hi != polyhole.holes_end(); ++hi) {
+		CGAL::Polygon_2<KE> hole;
+		for (auto v = hi->vertices_begin(); v != hi->vertices_end(); ++v)
+			hole.push_back(KE::Point_2(CGAL::to_double(v->x()), CGAL::to_double(v->y())));
+		exact_polyhole.add_hole(hole);
+	}
+
+	boost::shared_ptr<CGAL::Straight_skeleton_2<KE>> skeleton = CGAL::create_interior_straight_skeleton_2(exact_polyhole);
+	if (!skeleton)
+		return NULL;
+	return new kernel_offset_extractor<KE>(skeleton);
+}
+
+/* the walk needs every vertex to be clearly above or below the inset */
+bool offset_extractor::on_vertex(double t) const
+{
+	auto i = lower_bound(vertex_times.begin(), vertex_times.end(), t - 0.000000001);
+	return i != vertex_times.end() && *i <= t + 0.000000001;
+}
+
+double offset_extractor::safe_inset(double inset) const
+{
+	while (on_vertex(inset))
+		inset = inset + 0.00001;
+	return inset;
+}
+
+bool offsets_are_valid(const PolygonWithHolesPtrVector &polygons)
+{
+	for (auto ply : polygons) {
+		if (ply->outer_boundary().size() < 3 || !ply->outer_boundary().is_simple())
+			return false;
+		for (auto hi = ply->holes_begin(); hi != ply->holes_end(); ++hi)
+			if (hi->size() < 3 || !hi->is_simple())
+				return false;
+	}
+	return true;
+}
+
+template <class Handle>
+static inline bool crosses_up(Handle h, double t)
+{
+	return vtime(h->opposite()->vertex()) < t && vtime(h->vertex()) > t;
+}
+
+template <class Handle>
+static inline bool crosses_down(Handle h, double t)
+{
+	return vtime(h->opposite()->vertex()) > t && vtime(h->vertex()) < t;
+}
+
+template <class Handle>
+static Point point_at(Handle h, double t)
+{
+	auto s = h->opposite()->vertex();
+	auto v = h->vertex();
+	double t0 = vtime(s), t1 = vtime(v);
+	double l = (t - t0) / (t1 - t0);
+	double X0 = CGAL::to_double(s->point().x()), Y0 = CGAL::to_double(s->point().y());
+	double X1 = CGAL::to_double(v->point().x()), Y1 = CGAL::to_double(v->point().y());
+
+	return Point(X0 + l * (X1 - X0), Y0 + l * (Y1 - Y0));
+}
+
+/*
+ * Follow one contour: from where it crosses <start> going up, go around the
+ * face to where it comes back down, then over into the neighbouring face.
+ */
+template <class Kernel>
+bool kernel_offset_extractor<Kernel>::trace(typename Skeleton::Halfedge_const_handle start, double t, vector<int> &visited, int mark, Polygon_2 *poly) const
+{
+	typename Skeleton::Halfedge_const_handle cur = start;
+	unsigned int steps = 0;
+
+	do {
+		typename Skeleton::Halfedge_const_handle g;
+
+		if (visited[cur->id()] == mark)
+			return false;
+		visited[cur->id()] = mark;
+		poly->push_back(point_at(cur, t));
+
+		g = cur->next();
+		while (!crosses_down(g, t)) {
+			g = g->next();
+			if (g == cur || ++steps > 4 * (max_id + 1))
+				return false;
+		}
+		cur = g->opposite();
+		if (!cur->is_bisector() || !crosses_up(cur, t))
+			return false;
+	} while (cur != start);
+
+	if (poly->size() < 3)
+		return false;
+
+	/* the walk runs against the contour edges; give them CGAL's orientation */
+	poly->reverse_orientation();
+	return true;
+}
+
+template <class Kernel>
+void kernel_offset_extractor<Kernel>::extract(vector<double> &insets, vector<PolygonWithHolesPtrVector> &out, vector<bool> &ok) const
+{
+	vector<int> visited(max_id + 1, -1);
+	vector<unsigned int> active;
+	unsigned int next = 0;
+
+	out.assign(insets.size(), PolygonWithHolesPtrVector());
+	ok.assign(insets.size(), true);
+
+	for (unsigned int i = 0; i < insets.size(); i++) {
+		PolygonPtrVector contours;
+		double t = safe_inset(insets[i]);
+		unsigned int keep = 0;
+
+		insets[i] = t;
+		if (t >= max_time)
+			continue;
+
+		/* edges that started below t join, the ones that ended below t leave */
+		while (next < edges.size() && edges[next].t0 < t)
+			active.push_back(next++);
+		for (auto e : active)
+			if (edges[e].t1 > t)
+				active[keep++] = e;
+		active.resize(keep);
+
+		for (auto e : active) {
+			typename Skeleton::Halfedge_const_handle h = edges[e].h;
+			if (visited[h->id()] == (int)i)
+				continue;
+			PolygonPtr poly(new Polygon_2);
+			if (!trace(h, t, visited, i, poly.get())) {
+				ok[i] = false;
+				break;
+			}
+			contours.push_back(poly);
+		}
+		if (ok[i])
+			out[i] = CGAL::arrange_offset_polygons_2(contours);
+		if (ok[i] && !offsets_are_valid(out[i]))
+			ok[i] = false;
+	}
+}
+
+/* offsets in the kernel they were made in, to the default kernel the toolpaths are in */
+static PolygonWithHolesPtrVector to_default_kernel(const PolygonWithHolesPtrVector &in)
+{
+	return in;
+}
+
+static Polygon_2 to_default_kernel(const CGAL::Polygon_2<KE> &in)
+{
+	Polygon_2 out;
+
+	for (auto v = in.vertices_begin(); v != in.vertices_end(); ++v)
+		out.push_back(Point(CGAL::to_double(v->x()), CGAL::to_double(v->y())));
+	return out;
+}
+
+template <class PolyPtrVector>
+static PolygonWithHolesPtrVector to_default_kernel(const PolyPtrVector &in)
+{
+	PolygonWithHolesPtrVector out;
+
+	for (auto ply : in) {
+		PolygonWithHolesPtr p(new PolygonWithHoles(to_default_kernel(ply->outer_boundary())));
+		for (auto hi = ply->holes_begin(); hi != ply->holes_end(); ++hi)
+			p->add_hole(to_default_kernel(*hi));
+		out.push_back(p);
+	}
+	return out;
+}
+
+template <class Kernel>
+PolygonWithHolesPtrVector kernel_offset_extractor<Kernel>::offset(double inset) const
+{
+	return to_default_kernel(CGAL::arrange_offset_polygons_2(CGAL::create_offset_polygons_2<CGAL::Polygon_2<Kernel>>(inset, *skeleton)));
+}
+
+template <class Kernel>
+void kernel_offset_extractor<Kernel>::for_each_halfedge(const std::function<void(double X1, double Y1, double X2, double Y2, bool inner_bisector, bool bisector)> &fn) const
+{
+	for (auto x = skeleton->halfedges_begin(); x != skeleton->halfedges_end(); ++x)
+		fn(CGAL::to_double(x->vertex()->point().x()), CGAL::to_double(x->vertex()->point().y()),
+		   CGAL::to_double(x->opposite()->vertex()->point().x()), CGAL::to_double(x->opposite()->vertex()->point().y()),
+		   x->is_inner_bisector(), x->is_bisector());
+}
+
+/* in the FINE build the default kernel is the exact one */
+template class kernel_offset_extractor<K>;
+#ifndef FINE
+template class kernel_offset_extractor<KE>;
+#endif
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <functional>
+
+#include "tool.h"
+
+/*
+ * Offset contours straight from a straight skeleton, for many insets at
+ * once. A point at inset t lies on every skeleton edge whose two vertices
+ * are on either side of time t; the contour through it is found by walking
+ * around the skeleton faces. The edges are sorted by when they start once,
+ * so a sweep over ascending insets only looks at the edges that cross each
+ * of them, instead of CGAL walking the whole skeleton for every inset.
+ *
+ * Anything the walk can't make sense of is reported back so the caller can
+ * fall back to CGAL::create_offset_polygons_2 for that inset.
+ *
+ * The skeleton can be built in the default kernel K or in the exact kernel
+ * KE (for the shapes K can't handle); this is the part of the interface that
+ * doesn't depend on which, and everything it hands out is in K.
+ */
+class offset_extractor {
+public:
+	virtual ~offset_extractor() {};
+
+	/* the skeleton of <polyhole> in the default or the exact kernel; NULL if CGAL fails */
+	static class offset_extractor *create(const PolygonWithHoles &polyhole, bool exact);
+
+	/* no contours exist at or beyond this inset */
+	double max_inset(void) const { return max_time; };
+
+	/*
+	 * Offsetting exactly at the time of a skeleton vertex is what makes CGAL
+	 * throw; this moves <inset> up past any vertex it sits on.
+	 */
+	double safe_inset(double inset) const;
+
+	/*
+	 * contours at each of the ascending <insets>, arranged into polygons with
+	 * holes; the insets are passed through safe_inset() first, and the ones
+	 * actually used are stored back. ok[i] is false where the walk failed.
+	 */
+	virtual void extract(vector<double> &insets, vector<PolygonWithHolesPtrVector> &out, vector<bool> &ok) const = 0;
+
+	/* CGAL's own offset at <inset>; throws whatever CGAL throws */
+	virtual PolygonWithHolesPtrVector offset(double inset) const = 0;
+
+	/* X1/Y1 is the vertex a halfedge points to, X2/Y2 the one it comes from */
+	virtual void for_each_halfedge(const std::function<void(double X1, double Y1, double X2, double Y2, bool inner_bisector, bool bisector)> &fn) const = 0;
+
+protected:
+	vector<double> vertex_times;		/* sorted */
+	double max_time;
+
+	bool on_vertex(double t) const;
+};
+
+/* all offset polygons valid, as far as the toolpaths built from them are concerned */
+extern bool offsets_are_valid(const PolygonWithHolesPtrVector &polygons);
+
+template <class Kernel>
+class kernel_offset_extractor : public offset_extractor {
+public:
+	typedef CGAL::Straight_skeleton_2<Kernel> Skeleton;
+
+	kernel_offset_extractor(boost::shared_ptr<Skeleton> _skeleton);
+
+	void extract(vector<double> &insets, vector<PolygonWithHolesPtrVector> &out, vector<bool> &ok) const;
+	PolygonWithHolesPtrVector offset(double inset) const;
+	void for_each_halfedge(const std::function<void(double X1, double Y1, double X2, double Y2, bool inner_bisector, bool bisector)> &fn) const;
+
+private:
+	struct sweep_edge {
+		typename Skeleton::Halfedge_const_handle h;	/* pointing up, towards the later vertex */
+		double t0, t1;
+	};
+
+	boost::shared_ptr<Skeleton> skeleton;
+	vector<struct sweep_edge> edges;	/* by t0 */
+	unsigned int max_id;
+
+	bool trace(typename Skeleton::Halfedge_const_handle start, double t, vector<int> &visited, int mark, Polygon_2 *poly) const;
+};
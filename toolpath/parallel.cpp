@@ -0,0 +1,106 @@
+/*
+ * (C) Copyright 2019  -  Arjan van de Ven <arjanvandeven@gmail.com>
+ *
+ * This file is part of FenrusCNCtools
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "parallel.h"
+
+extern "C" {
+  #include "toolpath.h"
+}
+
+/* 0 means one per CPU */
+static unsigned int jobs = 0;
+
+void set_parallel_jobs(int _jobs)
+{
+	if (_jobs < 0)
+		_jobs = 0;
+	jobs = _jobs;
+}
+
+unsigned int parallel_jobs(void)
+{
+	if (jobs > 0)
+		return jobs;
+	if (std::thread::hardware_concurrency() > 0)
+		return std::thread::hardware_concurrency();
+	return 1;
+}
+
+/*
+ * Threads started by parallel_for() that are still working. Nested calls
+ * (offsets of one shape while other shapes are being planned) only get the
+ * threads that are left over, so there are never more than --jobs busy.
+ */
+static std::atomic<unsigned int> busy(0);
+
+/* how many more threads parallel_for() could start right now */
+unsigned int parallel_idle(void)
+{
+	unsigned int b = busy.load();
+	if (b + 1 >= parallel_jobs())
+		return 0;
+	return parallel_jobs() - 1 - b;
+}
+
+void parallel_for(unsigned int count, const std::function<void(unsigned int)> &body)
+{
+	std::vector<std::thread> workers;
+	std::atomic<unsigned int> next(0);
+	unsigned int threads = parallel_jobs();
+	unsigned int extra = 0;
+
+	if (threads > count)
+		threads = count;
+
+	while (extra + 1 < threads) {
+		unsigned int b = busy.load();
+		if (b + 1 >= parallel_jobs())
+			break;
+		if (busy.compare_exchange_weak(b, b + 1))
+			extra++;
+	}
+
+	if (extra == 0) {
+		for (unsigned int i = 0; i < count; i++)
+			body(i);
+		return;
+	}
+
+	auto worker = [&]() {
+		unsigned int i;
+		while ((i = next.fetch_add(1)) < count)
+			body(i);
+	};
+
+	for (unsigned int t = 0; t < extra; t++)
+		workers.push_back(std::thread([&]() {
+			worker();
+			busy--;
+		}));
+	worker();
+	for (auto &w : workers)
+		w.join();
+}
+
+std::thread parallel_background(const std::function<void()> &body)
+{
+	unsigned int b = busy.load();
+
+	do {
+		if (b + 1 >= parallel_jobs())
+			return std::thread();
+	} while (!busy.compare_exchange_weak(b, b + 1));
+
+	return std::thread([body]() {
+		body();
+		busy--;
+	});
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <functional>
+#include <thread>
+
+/*
+ * Run body(0) .. body(count - 1) spread over up to --jobs threads, including
+ * the calling one, and return once all of them are done. The bodies must not
+ * depend on each other; whoever merges their results does so in index order
+ * afterwards so the output does not depend on the scheduling.
+ */
+extern void parallel_for(unsigned int count, const std::function<void(unsigned int)> &body);
+extern unsigned int parallel_jobs(void);
+extern unsigned int parallel_idle(void);
+
+/*
+ * Start optional work on a thread of its own that counts against --jobs like
+ * the ones parallel_for() starts. If no thread is free nothing is started and
+ * the returned thread is not joinable; the work has to get done lazily then.
+ */
+extern std::thread parallel_background(const std::function<void()> &body);
@@ -0,0 +1,423 @@
+/*
+ * (C) Copyright 2019  -  Arjan van de Ven <arjanvandeven@gmail.com>
+ *
+ * This file is part of FenrusCNCtools
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "tool.h"
+#include "scene.h"
+
+extern "C" {
+  #include "toolpath.h"
+}
+
+/*
+ * A plan file holds everything write_gcode() needs from a planned scene:
+ * scene -> inputshape -> tooldepth -> toollevel -> toolpath -> Polygon_2.
+ * Loading one skips the skeletons and offsets entirely, so only the ordering
+ * and the G-code writing are redone.
+ *
+ * Everything is stored in host byte order: a header, then each object as its
+ * fields followed by a count and its children. Strings are a length and the
+ * bytes, with PLAN_NULL as the length of a NULL string.
+ */
+#define PLAN_MAGIC "FNRSPLAN"
+#define PLAN_VERSION 1
+#define PLAN_NULL 0xffffffffU
+
+struct plan_file {
+	FILE *file;
+	bool error;
+};
+
+static void put_u32(struct plan_file *plan, uint32_t value)
+{
+	if (fwrite(&value, sizeof(value), 1, plan->file) != 1)
+		plan->error = true;
+}
+
+static void put_double(struct plan_file *plan, double value)
+{
+	if (fwrite(&value, sizeof(value), 1, plan->file) != 1)
+		plan->error = true;
+}
+
+static void put_string(struct plan_file *plan, const char *str)
+{
+	if (!str) {
+		put_u32(plan, PLAN_NULL);
+		return;
+	}
+	put_u32(plan, strlen(str));
+	if (strlen(str) > 0 && fwrite(str, strlen(str), 1, plan->file) != 1)
+		plan->error = true;
+}
+
+static uint32_t get_u32(struct plan_file *plan)
+{
+	uint32_t value = 0;
+	if (fread(&value, sizeof(value), 1, plan->file) != 1)
+		plan->error = true;
+	return value;
+}
+
+static double get_double(struct plan_file *plan)
+{
+	double value = 0;
+	if (fread(&value, sizeof(value), 1, plan->file) != 1)
+		plan->error = true;
+	return value;
+}
+
+static const char *get_string(struct plan_file *plan)
+{
+	uint32_t len = get_u32(plan);
+	char *str;
+
+	if (plan->error || len == PLAN_NULL)
+		return NULL;
+	/* anything longer than a name means a damaged file */
+	if (len > 65536) {
+		plan->error = true;
+		return NULL;
+	}
+	str = (char *)calloc(len + 1, 1);
+	if (len > 0 && fread(str, len, 1, plan->file) != 1)
+		plan->error = true;
+	return str;
+}
+
+/* counts of things to follow; a damaged file should not make us allocate the world */
+static uint32_t get_count(struct plan_file *plan)
+{
+	uint32_t count = get_u32(plan);
+	if (count > 100000000) {
+		plan->error = true;
+		return 0;
+	}
+	return count;
+}
+
+static void put_polygon(struct plan_file *plan, Polygon_2 *poly)
+{
+	put_u32(plan, poly->size());
+	for (auto vi = poly->vertices_begin(); vi != poly->vertices_end(); ++vi) {
+		put_double(plan, CGAL::to_double(vi->x()));
+		put_double(plan, CGAL::to_double(vi->y()));
+	}
+}
+
+static void get_polygon(struct plan_file *plan, Polygon_2 *poly)
+{
+	uint32_t count = get_count(plan);
+	for (uint32_t i = 0; i < count && !plan->error; i++) {
+		double X = get_double(plan);
+		double Y = get_double(plan);
+		poly->push_back(Point(X, Y));
+	}
+}
+
+static void put_toolpath(struct plan_file *plan, class toolpath *tp)
+{
+	uint32_t flags = 0;
+
+	flags |= tp->is_hole ? 1 : 0;
+	flags |= tp->is_slotting ? 2 : 0;
+	flags |= tp->is_optional ? 4 : 0;
+	flags |= tp->is_vcarve ? 8 : 0;
+	flags |= tp->is_single ? 16 : 0;
+	flags |= tp->run_reverse ? 32 : 0;
+
+	put_u32(plan, tp->level);
+	put_u32(plan, tp->toolnr);
+	put_u32(plan, flags);
+	put_u32(plan, tp->start_vertex);
+	put_double(plan, tp->diameter);
+	put_double(plan, tp->depth);
+	put_double(plan, tp->depth2);
+	put_double(plan, tp->length);
+	put_double(plan, tp->minY);
+	put_double(plan, tp->priority);
+	put_string(plan, tp->color);
+	put_u32(plan, tp->polygons.size());
+	for (auto poly : tp->polygons)
+		put_polygon(plan, poly);
+}
+
+static class toolpath *get_toolpath(struct plan_file *plan)
+{
+	class toolpath *tp = new(class toolpath);
+	uint32_t flags, count;
+
+	tp->level = get_u32(plan);
+	tp->toolnr = get_u32(plan);
+	flags = get_u32(plan);
+	tp->is_hole = flags & 1;
+	tp->is_slotting = flags & 2;
+	tp->is_optional = flags & 4;
+	tp->is_vcarve = flags & 8;
+	tp->is_single = flags & 16;
+	tp->run_reverse = flags & 32;
+	tp->start_vertex = get_u32(plan);
+	tp->diameter = get_double(plan);
+	tp->depth = get_double(plan);
+	tp->depth2 = get_double(plan);
+	tp->length = get_double(plan);
+	tp->minY = get_double(plan);
+	tp->priority = get_double(plan);
+	tp->color = get_string(plan);
+	count = get_count(plan);
+	for (uint32_t i = 0; i < count && !plan->error; i++) {
+		Polygon_2 *poly = new(Polygon_2);
+		get_polygon(plan, poly);
+		tp->add_polygon(poly);
+	}
+	return tp;
+}
+
+static void put_toollevel(struct plan_file *plan, class toollevel *tl)
+{
+	uint32_t flags = 0;
+
+	flags |= tl->is_optional ? 1 : 0;
+	flags |= tl->is_slotting ? 2 : 0;
+	flags |= tl->run_reverse ? 4 : 0;
+	flags |= tl->is_single ? 8 : 0;
+	flags |= tl->no_sort ? 16 : 0;
+
+	put_u32(plan, tl->level);
+	put_u32(plan, tl->toolnr);
+	put_u32(plan, flags);
+	put_double(plan, tl->offset);
+	put_double(plan, tl->diameter);
+	put_double(plan, tl->depth);
+	put_double(plan, tl->minY);
+	put_string(plan, tl->name);
+	put_u32(plan, tl->toolpaths.size());
+	for (auto tp : tl->toolpaths)
+		put_toolpath(plan, tp);
+}
+
+static class toollevel *get_toollevel(struct plan_file *plan)
+{
+	class toollevel *tl = new(class toollevel);
+	uint32_t flags, count;
+
+	tl->level = get_u32(plan);
+	tl->toolnr = get_u32(plan);
+	flags = get_u32(plan);
+	tl->is_optional = flags & 1;
+	tl->is_slotting = flags & 2;
+	tl->run_reverse = flags & 4;
+	tl->is_single = flags & 8;
+	tl->no_sort = flags & 16;
+	tl->offset = get_double(plan);
+	tl->diameter = get_double(plan);
+	tl->depth = get_double(plan);
+	tl->minY = get_double(plan);
+	tl->name = get_string(plan);
+	count = get_count(plan);
+	for (uint32_t i = 0; i < count && !plan->error; i++)
+		tl->toolpaths.push_back(get_toolpath(plan));
+	return tl;
+}
+
+static void put_tooldepth(struct plan_file *plan, class tooldepth *td)
+{
+	put_u32(plan, td->level);
+	put_u32(plan, td->toolnr);
+	put_u32(plan, (td->is_slotting ? 1 : 0) | (td->run_reverse ? 2 : 0));
+	put_double(plan, td->diameter);
+	put_double(plan, td->depth);
+	put_string(plan, td->name);
+	put_u32(plan, td->toollevels.size());
+	for (auto tl : td->toollevels)
+		put_toollevel(plan, tl);
+}
+
+static class tooldepth *get_tooldepth(struct plan_file *plan)
+{
+	class tooldepth *td = new(class tooldepth);
+	uint32_t flags, count;
+
+	td->level = get_u32(plan);
+	td->toolnr = get_u32(plan);
+	flags = get_u32(plan);
+	td->is_slotting = flags & 1;
+	td->run_reverse = flags & 2;
+	td->diameter = get_double(plan);
+	td->depth = get_double(plan);
+	td->name = get_string(plan);
+	count = get_count(plan);
+	for (uint32_t i = 0; i < count && !plan->error; i++)
+		td->toollevels.push_back(get_toollevel(plan));
+	return td;
+}
+
+static void put_shape(struct plan_file *plan, class inputshape *shape)
+{
+	vector<class tooldepth *> depths = shape->get_tooldepths();
+
+	put_u32(plan, shape->level);
+	put_u32(plan, shape->is_cutout);
+	put_double(plan, shape->area);
+	put_double(plan, shape->get_minY());
+	put_double(plan, shape->get_z_offset());
+	put_double(plan, shape->get_stock_to_leave());
+	put_double(plan, shape->get_cutout_offset());
+	put_double(plan, shape->get_depth());
+	put_string(plan, shape->get_name());
+	put_polygon(plan, &shape->poly);
+
+	put_u32(plan, depths.size());
+	for (auto td : depths)
+		put_tooldepth(plan, td);
+	put_u32(plan, shape->children.size());
+	for (auto child : shape->children)
+		put_shape(plan, child);
+}
+
+static class inputshape *get_shape(struct plan_file *plan, class scene *scene)
+{
+	class inputshape *shape = new(class inputshape);
+	uint32_t count;
+
+	shape->parent = scene;
+	shape->level = get_u32(plan);
+	shape->is_cutout = get_u32(plan);
+	shape->area = get_double(plan);
+	shape->set_minY(get_double(plan));
+	shape->set_z_offset(get_double(plan));
+	shape->set_stock_to_leave(get_double(plan));
+	shape->set_cutout_offset(get_double(plan));
+	shape->set_depth(get_double(plan));
+	const char *name = get_string(plan);
+	if (name)
+		shape->set_name(name);
+	get_polygon(plan, &shape->poly);
+
+	count = get_count(plan);
+	for (uint32_t i = 0; i < count && !plan->error; i++) {
+		class tooldepth *td = get_tooldepth(plan);
+		shape->add_tooldepth(td, td->toolnr);
+	}
+	count = get_count(plan);
+	for (uint32_t i = 0; i < count && !plan->error; i++)
+		shape->children.push_back(get_shape(plan, scene));
+	return shape;
+}
+
+bool scene::save_plan(const char *planfile)
+{
+	struct plan_file plan;
+
+	plan.file = fopen(planfile, "wb");
+	plan.error = false;
+	if (!plan.file) {
+		printf("Cannot write plan %s: %s\n", planfile, strerror(errno));
+		return false;
+	}
+
+	if (fwrite(PLAN_MAGIC, strlen(PLAN_MAGIC), 1, plan.file) != 1)
+		plan.error = true;
+	put_u32(&plan, PLAN_VERSION);
+
+	put_double(&plan, minX);
+	put_double(&plan, minY);
+	put_double(&plan, maxX);
+	put_double(&plan, maxY);
+	put_double(&plan, depth);
+	put_double(&plan, z_offset);
+	put_double(&plan, cutout_depth);
+	put_double(&plan, stock_to_leave);
+	put_string(&plan, filename);
+
+	put_u32(&plan, toollist.size());
+	for (auto t : toollist)
+		put_u32(&plan, t);
+
+	put_u32(&plan, cutout ? 1 : 0);
+	if (cutout)
+		put_shape(&plan, cutout);
+	put_u32(&plan, shapes.size());
+	for (auto shape : shapes)
+		put_shape(&plan, shape);
+
+	if (fclose(plan.file) != 0)
+		plan.error = true;
+	if (plan.error) {
+		printf("Error writing plan %s\n", planfile);
+		return false;
+	}
+	qprintf("Plan saved to %s\n", planfile);
+	return true;
+}
+
+bool scene::load_plan(const char *planfile)
+{
+	struct plan_file plan;
+	char magic[sizeof(PLAN_MAGIC)] = {};
+	uint32_t count;
+
+	plan.file = fopen(planfile, "rb");
+	plan.error = false;
+	if (!plan.file) {
+		printf("Cannot open plan %s: %s\n", planfile, strerror(errno));
+		return false;
+	}
+
+	if (fread(magic, strlen(PLAN_MAGIC), 1, plan.file) != 1 || strcmp(magic, PLAN_MAGIC) != 0) {
+		printf("%s is not a toolpath plan\n", planfile);
+		fclose(plan.file);
+		return false;
+	}
+	if (get_u32(&plan) != PLAN_VERSION) {
+		printf("Plan %s was written by a different version\n", planfile);
+		fclose(plan.file);
+		return false;
+	}
+
+	minX = get_double(&plan);
+	minY = get_double(&plan);
+	maxX = get_double(&plan);
+	maxY = get_double(&plan);
+	depth = get_double(&plan);
+	z_offset = get_double(&plan);
+	cutout_depth = get_double(&plan);
+	stock_to_leave = get_double(&plan);
+	filename = get_string(&plan);
+	if (!filename)
+		filename = "unknown";
+
+	toollist.clear();
+	count = get_count(&plan);
+	for (uint32_t i = 0; i < count && !plan.error; i++) {
+		int toolnr = get_u32(&plan);
+		if (!have_tool(toolnr))
+			printf("Plan %s uses tool %i, which is not in the tool library\n", planfile, toolnr);
+		toollist.push_back(toolnr);
+	}
+
+	cutout = NULL;
+	if (get_u32(&plan))
+		cutout = get_shape(&plan, this);
+	shapes.clear();
+	count = get_count(&plan);
+	for (uint32_t i = 0; i < count && !plan.error; i++)
+		shapes.push_back(get_shape(&plan, this));
+
+	fclose(plan.file);
+	if (plan.error || toollist.size() == 0) {
+		printf("Plan %s is damaged\n", planfile);
+		return false;
+	}
+	vprintf("Loaded plan %s: %i shapes, %i tools\n", planfile, (int)shapes.size(), (int)toollist.size());
+	return true;
+}
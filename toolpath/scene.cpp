@@ -5,6 +5,9 @@
  *
  * SPDX-License-Identifier: GPL-3.0
  */
+#include <thread>
+#include <algorithm>
+
 #include "tool.h"
 
 #include "scene.h"
@@ -14,6 +17,8 @@ extern "C" {
 }
 
 #include "endmill.h"
+#include "gcode.h"
+#include "parallel.h"
 
 static inline double dist(double X0, double Y0, double X1, double Y1)
 {
@@ -159,52 +164,452 @@ void scene::write_svg(const char *filename)
   write_svg_footer();
 }
 
-void scene::write_naked_gcode()
+/*
+ * The order shapes get cut in, per tool. The shapes vector is in area order,
+ * which has the tool criss-crossing the sheet between many small pockets;
+ * this treats each shape (with its children) as one stop of an open
+ * travelling salesman tour from the current tool position, built nearest
+ * neighbour first and then improved with Or-opt. A shape that lies inside
+ * another (an island in a hole) still gets cut before the outer one.
+ *
+ * The travel between two shapes is taken as the gap between their bounding
+ * boxes; the distance between the box centers breaks ties.
+ */
+#define OR_OPT_PASSES 8
+#define OR_OPT_SEGMENT 3
+
+struct shape_stop {
+	double X1, Y1, X2, Y2;	/* bounding box */
+	double cX, cY;
+	vector<int> before;	/* stops that have to be cut before this one */
+};
+
+static double stop_gap(const struct shape_stop &A, const struct shape_stop &B)
+{
+	double dx = fmax(0, fmax(A.X1 - B.X2, B.X1 - A.X2));
+	double dy = fmax(0, fmax(A.Y1 - B.Y2, B.Y1 - A.Y2));
+	return sqrt(dx * dx + dy * dy);
+}
+
+static double stop_cost(const vector<struct shape_stop> &stops, int a, int b)
+{
+	return stop_gap(stops[a], stops[b]) + 0.001 * dist(stops[a].cX, stops[a].cY, stops[b].cX, stops[b].cY);
+}
+
+static bool order_is_valid(const vector<struct shape_stop> &stops, const vector<int> &order)
+{
+	vector<int> pos(order.size());
+	for (unsigned int i = 0; i < order.size(); i++)
+		pos[order[i]] = i;
+	for (unsigned int i = 0; i < order.size(); i++)
+		for (auto b : stops[order[i]].before)
+			if (pos[b] > (int)i)
+				return false;
+	return true;
+}
+
+/*
+ * Within the tour, a tool can take each shape to full depth before moving
+ * on (depth first, the classic order) or cut one layer of every shape before
+ * going down (level first, which keeps the chip load even over the sheet).
+ * In auto mode the non-cutting time of both is estimated and the cheaper one
+ * is used: every layer is entered by retracting, a rapid over, and plunging
+ * at the plunge rate of the tool, as the writer does.
+ *
+ * Both orders retract and plunge once per layer, so only the rapids differ:
+ * depth first crosses each shape between its own layers, level first hops
+ * between neighbouring shapes. Auto therefore stays depth first for compact
+ * pockets far apart, and goes level first for long shapes close together:
+ * three 100x5 mm slots on a 10 mm pitch, three layers each, take roughly
+ * 320 mm of rapids depth first and 160 mm level first.
+ */
+enum { POCKET_ORDER_AUTO, POCKET_ORDER_DEPTH, POCKET_ORDER_LEVEL };
+
+static int pocket_order = POCKET_ORDER_AUTO;
+
+int scene_set_pocket_order(const char *name)
+{
+  if (strcmp(name, "auto") == 0)
+    pocket_order = POCKET_ORDER_AUTO;
+  else if (strcmp(name, "depth") == 0)
+    pocket_order = POCKET_ORDER_DEPTH;
+  else if (strcmp(name, "level") == 0)
+    pocket_order = POCKET_ORDER_LEVEL;
+  else
+    return -1;
+  return 0;
+}
+
+/* the layers of a shape for a tool, top one first, as inputshape::output_gcode() runs them */
+static vector<class tooldepth *> shape_layers(class inputshape *shape, int toolnr)
+{
+  vector<class tooldepth *> depths = shape->get_tooldepths();
+  vector<class tooldepth *> layers;
+
+  toolnr = abs(toolnr);
+  for (auto i = depths.rbegin(); i != depths.rend(); ++i)
+    if ((*i)->toolnr == toolnr || toolnr == 0)
+      layers.push_back(*i);
+  return layers;
+}
+
+/* minutes to get from the bottom of one layer into the next one */
+static double layer_link_time(double fromZ, double toZ, double travel, double plungerate)
+{
+  double H = get_retract_height_metric();
+  double rapid = gcode_get_rapid_rate();
+
+  return (H - fromZ) / rapid + travel / rapid + (H - toZ) / plungerate;
+}
+
+/* rapid distance between two stops; within a stop, assume half its diagonal */
+static double stop_travel(const vector<struct shape_stop> &stops, int a, int b)
+{
+  if (a == b)
+    return dist(stops[a].X1, stops[a].Y1, stops[a].X2, stops[a].Y2) / 2;
+  return dist(stops[a].cX, stops[a].cY, stops[b].cX, stops[b].cY);
+}
+
+static bool want_level_first(int toolnr, vector<class inputshape *> &work, vector<struct shape_stop> &stops, vector<int> &order)
+{
+  vector<vector<class tooldepth *>> layers(stops.size());
+  class endmill *mill = get_endmill(toolnr);
+  double plungerate;
+  double depth_cost = 0, level_cost = 0;
+  unsigned int max_layers = 0;
+
+  if (pocket_order == POCKET_ORDER_DEPTH || !mill || mill->is_vbit() || work.size() < 2)
+    return false;
+  plungerate = mill->get_plungerate();
+
+  for (unsigned int i = 1; i < order.size(); i++) {
+    class inputshape *shape = work[order[i] - 1];
+    /* children get output from within the parent; only plain shapes can be split up */
+    for (auto c : shape->children)
+      if (c->has_work(toolnr))
+        return false;
+    layers[order[i]] = shape_layers(shape, toolnr);
+    max_layers = max(max_layers, (unsigned int)layers[order[i]].size());
+  }
+  /*
+   * an island has to be finished before the shape around it, which no
+   * layer by layer order can do; the back and forth tour doesn't even try
+   */
+  for (auto &s : stops)
+    if (s.before.size() > 0) {
+      if (pocket_order == POCKET_ORDER_LEVEL)
+        vprintf("Tool %i: shapes inside other shapes, cutting depth first\n", toolnr);
+      return false;
+    }
+  if (pocket_order == POCKET_ORDER_LEVEL)
+    return true;
+  if (max_layers < 2 || plungerate <= 0)
+    return false;
+
+  /* depth first: down through each shape in tour order */
+  int prev = 0;
+  double prevZ = get_retract_height_metric();
+  for (unsigned int i = 1; i < order.size(); i++)
+    for (auto td : layers[order[i]]) {
+      depth_cost += layer_link_time(prevZ, td->depth, stop_travel(stops, prev, order[i]), plungerate);
+      prev = order[i];
+      prevZ = td->depth;
+    }
+
+  /* level first: the tour once per layer, back and forth */
+  prev = 0;
+  prevZ = get_retract_height_metric();
+  for (unsigned int l = 0; l < max_layers; l++)
+    for (unsigned int k = 1; k < order.size(); k++) {
+      int s = order[(l & 1) ? order.size() - k : k];
+      if (l >= layers[s].size())
+        continue;
+      level_cost += layer_link_time(prevZ, layers[s][l]->depth, stop_travel(stops, prev, s), plungerate);
+      prev = s;
+      prevZ = layers[s][l]->depth;
+    }
+
+  vprintf("Tool %i: %5.2f minutes moving between layers depth first, %5.2f level first\n", toolnr, depth_cost, level_cost);
+  return level_cost < depth_cost;
+}
+
+static void output_level_first(class gcode_writer *gcode, int toolnr, vector<class inputshape *> &work, vector<int> &order)
+{
+  vector<vector<class tooldepth *>> layers(order.size());
+  unsigned int max_layers = 0;
+
+  for (unsigned int i = 1; i < order.size(); i++) {
+    layers[i] = shape_layers(work[order[i] - 1], toolnr);
+    max_layers = max(max_layers, (unsigned int)layers[i].size());
+  }
+
+  gcode->write_comment("Level first");
+  for (unsigned int l = 0; l < max_layers; l++)
+    for (unsigned int k = 1; k < order.size(); k++) {
+      unsigned int i = (l & 1) ? order.size() - k : k;
+      if (l >= layers[i].size())
+        continue;
+      gcode->write_comment("Shape");
+      layers[i][l]->output_gcode(gcode);
+    }
+}
+
+void scene::output_shapes(class gcode_writer *gcode, int toolnr)
+{
+  vector<class inputshape *> work;
+  vector<struct shape_stop> stops;
+  vector<int> order;
+  vector<bool> done;
+  unsigned int i, j;
+
+  for (auto s : shapes)
+    if (s->has_work(toolnr))
+      work.push_back(s);
+
+  if (work.size() == 0) {
+    for (auto s : shapes)
+      s->output_gcode(gcode, toolnr);
+    return;
+  }
+
+  /* stop 0 is where the tool is now, in the (unshifted) coordinates of the shapes */
+  stops.resize(work.size() + 1);
+  stops[0].X1 = stops[0].X2 = stops[0].cX = gcode->current_X();
+  stops[0].Y1 = stops[0].Y2 = stops[0].cY = gcode->current_Y() + get_minY();
+  for (i = 0; i < work.size(); i++) {
+    CGAL::Bbox_2 bb = work[i]->get_bbox();
+    struct shape_stop *s = &stops[i + 1];
+    s->X1 = bb.xmin();
+    s->Y1 = bb.ymin();
+    s->X2 = bb.xmax();
+    s->Y2 = bb.ymax();
+    s->cX = (s->X1 + s->X2) / 2;
+    s->cY = (s->Y1 + s->Y2) / 2;
+  }
+  for (i = 0; i < work.size(); i++)
+    for (j = 0; j < work.size(); j++) {
+      struct shape_stop *in = &stops[i + 1], *out = &stops[j + 1];
+      if (i == j || in->X1 < out->X1 || in->X2 > out->X2 || in->Y1 < out->Y1 || in->Y2 > out->Y2)
+        continue;
+      /*
+       * identical or edge sharing shapes fit inside each other; only the
+       * smaller (or, as the area sort had it, the earlier) one goes first
+       */
+      if (fabs(work[i]->area) > fabs(work[j]->area) || (fabs(work[i]->area) == fabs(work[j]->area) && i > j))
+        continue;
+      if (work[i]->fits_inside(work[j]))
+        out->before.push_back(i + 1);
+    }
+
+  /* nearest neighbour, among the stops whose inner shapes are done */
+  done.assign(stops.size(), false);
+  done[0] = true;
+  order.push_back(0);
+  while (order.size() < stops.size()) {
+    int best = -1;
+    double best_cost = 0;
+    for (i = 1; i < stops.size(); i++) {
+      bool ready = !done[i];
+      for (auto b : stops[i].before)
+        ready = ready && done[b];
+      if (!ready)
+        continue;
+      double c = stop_cost(stops, order.back(), i);
+      if (best < 0 || c < best_cost) {
+        best = i;
+        best_cost = c;
+      }
+    }
+    /* can't happen with the tie break above, but never leave a shape out */
+    if (best < 0)
+      for (i = stops.size() - 1; i >= 1; i--)
+        if (!done[i])
+          best = i;
+    done[best] = true;
+    order.push_back(best);
+  }
+
+  /* Or-opt: move runs of up to OR_OPT_SEGMENT stops elsewhere in the tour, possibly reversed */
+  for (int pass = 0; pass < OR_OPT_PASSES; pass++) {
+    bool improved = false;
+    int n = order.size();
+    for (int len = 1; len <= OR_OPT_SEGMENT; len++) {
+      for (int from = 1; from + len <= n; from++) {
+        int prev = order[from - 1], first = order[from], last = order[from + len - 1];
+        int next = (from + len < n) ? order[from + len] : -1;
+        double gain;
+
+        gain = stop_cost(stops, prev, first);
+        if (next >= 0)
+          gain += stop_cost(stops, last, next) - stop_cost(stops, prev, next);
+
+        for (int to = 0; to < n; to++) {
+          int t, u;
+          double add, add_rev;
+
+          /* insert after position <to>, which has to be outside the run */
+          if (to >= from - 1 && to < from + len)
+            continue;
+          t = order[to];
+          u = (to + 1 < n) ? order[to + 1] : -1;
+          add = stop_cost(stops, t, first);
+          add_rev = stop_cost(stops, t, last);
+          if (u >= 0) {
+            add += stop_cost(stops, last, u) - stop_cost(stops, t, u);
+            add_rev += stop_cost(stops, first, u) - stop_cost(stops, t, u);
+          }
+          if (fmin(add, add_rev) >= gain - 0.001)
+            continue;
+
+          vector<int> trial = order;
+          vector<int> seg(trial.begin() + from, trial.begin() + from + len);
+          if (add_rev < add)
+            reverse(seg.begin(), seg.end());
+          trial.erase(trial.begin() + from, trial.begin() + from + len);
+          trial.insert(trial.begin() + ((to < from) ? to + 1 : to + 1 - len), seg.begin(), seg.end());
+          if (!order_is_valid(stops, trial))
+            continue;
+          order = trial;
+          improved = true;
+          break;
+        }
+      }
+    }
+    if (!improved)
+      break;
+  }
+
+  if (want_level_first(toolnr, work, stops, order)) {
+    output_level_first(gcode, toolnr, work, order);
+  } else {
+    for (i = 1; i < order.size(); i++)
+      work[order[i] - 1]->output_gcode(gcode, toolnr);
+  }
+  /* shapes without work for this tool still leave their comment behind */
+  for (auto s : shapes)
+    if (std::find(work.begin(), work.end(), s) == work.end())
+      s->output_gcode(gcode, toolnr);
+}
+
+void scene::write_naked_gcode(class gcode_writer *gcode)
 {
   unsigned int j;
   unsigned int start = 0;
 
   if (tool_is_vcarve(toollist[0]) && toollist.size() > 1) {
-	  gcode_tool_change(toollist[1]);
+	  gcode->tool_change(toollist[1]);
 	  start = 1;
   } else {
-	  gcode_tool_change(toollist[0]);
+	  gcode->tool_change(toollist[0]);
   }
 		
   
   for (j = start; j < toollist.size() ; j++) {
-    for (auto i : shapes) {
-      i->output_gcode(toollist[j]);
-    }
+    wait_for_tool(toollist[j]);
+    output_shapes(gcode, toollist[j]);
 	if (cutout) {
-		gcode_reset_current();
-		cutout->output_gcode(toollist[j]);
+		gcode->reset_current();
+		cutout->output_gcode(gcode, toollist[j]);
 	}
+	if (streaming)
+		gcode->sync();
     if (j < toollist.size() - 1) {
-          gcode_tool_change(toollist[j + 1]);
+          gcode->tool_change(toollist[j + 1]);
     }
     
   }
 
   if (tool_is_vcarve(toollist[0]) && toollist.size() > 1) {
-      gcode_tool_change(toollist[0]);
-      for (auto i : shapes) {
-        i->output_gcode(toollist[0]);
-      }
+      gcode->tool_change(toollist[0]);
+      wait_for_tool(toollist[0]);
+      output_shapes(gcode, toollist[0]);
   }
 }
 
 
+/* one file of a --separate job, holding everything tool <toolnr> cuts */
+void scene::write_tool_gcode(const char *filename, int filenr, int toolnr, bool with_cutout)
+{
+  class gcode_writer *gcode = new gcode_writer();
+
+  gcode->set_file_number(filenr);
+  gcode->reset_current();
+  gcode->activate_tool(toolnr);
+  gcode->write_header(filename);
+  gcode->tool_change(toolnr);
+
+  wait_for_tool(toolnr);
+  output_shapes(gcode, toolnr);
+  if (cutout && with_cutout) {
+    gcode->reset_current();
+    cutout->output_gcode(gcode, toolnr);
+  }
+
+  gcode->write_footer();
+  delete gcode;
+}
+
+/*
+ * With one file per tool, each file only depends on the toolpaths of its own
+ * tool, so the files are written in parallel, numbered in the order that
+ * write_naked_gcode() would have produced them.
+ */
+void scene::write_separate_gcode(const char *filename)
+{
+  vector<std::thread> workers;
+  unsigned int j;
+  unsigned int start = 0;
+  int filenr = 0;
+
+  if (tool_is_vcarve(toollist[0]) && toollist.size() > 1)
+    start = 1;
+
+  for (j = start; j < toollist.size(); j++)
+    workers.push_back(std::thread(&scene::write_tool_gcode, this, filename, ++filenr, toollist[j], true));
+  if (start == 1)
+    workers.push_back(std::thread(&scene::write_tool_gcode, this, filename, ++filenr, toollist[0], false));
+
+  for (auto &w : workers)
+    w.join();
+}
+
 void scene::write_gcode(const char *filename, const char *description)
 {
   qprintf("Writing gcode for %s to %s\n", description, filename);
-  gcode_reset_current();
-  activate_tool(toollist[0]);
-  write_gcode_header(filename);
 
-  write_naked_gcode();
+  /* the adaptive stock model needs to see the earlier tools, so that stays serial */
+  if (gcode_separate_files() && !gcode_is_adaptive()) {
+    write_separate_gcode(filename);
+    return;
+  }
+
+  class gcode_writer *gcode = new gcode_writer();
+
+  gcode->reset_current();
+  gcode->activate_tool(toollist[0]);
+  gcode->write_header(filename);
+
+  write_naked_gcode(gcode);
   
-  write_gcode_footer();
+  gcode->write_footer();
+  delete gcode;
+}
+
+/*
+ * Plan and write at the same time: the planner thread works through the tools
+ * in output order while this thread writes (and flushes) every tool as soon as
+ * it is ready, so a sender can start on the first tool long before the last
+ * one is planned.
+ */
+void scene::write_gcode_streamed(const char *filename, const char *description)
+{
+  streaming = true;
+  std::thread planner(&scene::plan_in_output_order, this);
+
+  write_gcode(filename, description);
+
+  planner.join();
+  streaming = false;
 }
 
 
@@ -265,110 +670,130 @@ void scene::process_nesting(void)
       shapes[i]->set_level(0);
       shapes[i]->fix_orientation();
   }
+
+  start_skeleton_stage();
 }
 
-void scene::create_toolpaths(void)
+/*
+ * The straight skeletons are the expensive part of planning, and once the
+ * nesting is done each shape has its final holes. Build them on otherwise
+ * idle threads from here on, so they are (mostly) there by the time the
+ * tool and depth loop asks for them; a shape the stage has not gotten to
+ * yet just builds its own.
+ */
+void scene::start_skeleton_stage(void)
 {
-  double currentdepth;
-  double depthstep;
-  double surplus;
-  int finish = 0;
-  int toolnr = 0;
-  int tool;
-
-  depth = -fabs(depth);
-
-  qprintf("Creating toolpath for depth %5.2f with offset %5.2f\n", depth, z_offset);
+  vector<class inputshape *> todo = shapes;
+
+  wait_for_skeletons();
+  skeleton_stage = parallel_background([todo]() {
+    parallel_for(todo.size(), [&](unsigned int i) {
+      if (!todo[i]->is_null_shape())
+        todo[i]->build_skeleton();
+    });
+  });
+}
 
-  if (want_inlay()) {
-		inlay_plug = clone_scene(NULL, 1, maxX);
-	    inlay_plug->set_depth(depth / 1.25);
-		inlay_plug->create_toolpaths(); 
-  }
-  
-  vprintf("create_toolpaths with depth %5.2f\n", depth);
+void scene::wait_for_skeletons(void)
+{
+  if (skeleton_stage.joinable())
+    skeleton_stage.join();
+}
 
-  /* cutout toolpath first */
+void scene::create_cutout_toolpaths(void)
+{
 	if (cutout) {
 		int toolnr = 0;
 		if (tool_is_vcarve(toollist[0]) && toollist.size() > 1)
 			toolnr = 1;
 		cutout->create_toolpaths_cutout(toollist[toolnr], - fabs(cutout_depth), want_finishing_pass());
 	}  
-  
-  tool = toollist.size() -1;
-  while (tool >= 0) {
-    double start, end;
-    currentdepth = depth;
-    toolnr = toollist[tool];  
+}
+
+/*
+ * all depths of toollist[tool]; nothing carries over from the other tools, so
+ * planning them back to front or in output order gives the same toolpaths
+ */
+void scene::create_tool_toolpaths(int tool)
+{
+  int finish = 0;
+  double currentdepth;
+  double depthstep;
+  double surplus;
+  double start, end;
+  int toolnr = 0;
+
+  currentdepth = depth;
+  toolnr = toollist[tool];  
 	class endmill *mill;
 	class endmill *mill0 = get_endmill(toollist[0]);
-    activate_tool(toolnr);
+  activate_tool(toolnr);
 	mill = get_endmill(toolnr);
   
-    depthstep = mill->get_depth_of_cut();
+  depthstep = mill->get_depth_of_cut();
 
-    int rounds = (int)ceilf(-depth / depthstep);
-    surplus = rounds * depthstep + depth;
+  int rounds = (int)ceilf(-depth / depthstep);
+  surplus = rounds * depthstep + depth;
   
-    /* if we have spare height, split evenly between first and last cut */
-    depthstep = depthstep - surplus / 2;
+  /* if we have spare height, split evenly between first and last cut */
+  depthstep = depthstep - surplus / 2;
 
 
-    if (want_finishing_pass() && !mill->is_vbit()) {
-      /* finishing rules: deepest cut is small, 2x stock_to_leave */
-      depthstep = fmin(depthstep, stock_to_leave * 2);
-      finish  = 1;
-    }
-    
-    start = 0;
-    end = 60000000;
-    
-    /* we want courser tools to not get within the stepover of the finer tool */
+  if (want_finishing_pass() && !mill->is_vbit()) {
+    /* finishing rules: deepest cut is small, 2x stock_to_leave */
+    depthstep = fmin(depthstep, stock_to_leave * 2);
+    finish  = 1;
+  }
+  
+  start = 0;
+  end = 60000000;
+  
+  /* we want courser tools to not get within the stepover of the finer tool */
 	/* but actually that's a mess, we'll leave 0.1mm stock to leave and that's it */
-    if (tool < (int)toollist.size() -1)
+  if (tool < (int)toollist.size() -1)
 //      start = get_tool_stepover(toollist[tool+1]);
 		start = 0.1;
-    
-    /* if tool 0 is a vcarve bit, tool 1 needs to start at radius at depth of cut */
-    /* and all others need an offset */
-    if (tool > 0 && mill0->is_vbit()) {
+  
+  /* if tool 0 is a vcarve bit, tool 1 needs to start at radius at depth of cut */
+  /* and all others need an offset */
+  if (tool > 0 && mill0->is_vbit()) {
 		if (tool == 1)
 			start = 0;
 		start += mill0->distance_of_geometry(depth);
-    }
-      
-    if (tool > 0) {
+  }
+    
+  if (tool > 0) {
 		class endmill *prevmill;
 		prevmill = get_endmill(toollist[tool-1]);
 		end = prevmill->get_diameter()/2 + 0.2;
 	}
-      
-    if (tool == 1 && mill0->is_vbit())
-      end = 600000000;
-      
-      
-    if (mill->is_vbit() && tool == 0) {
+    
+  if (tool == 1 && mill0->is_vbit())
+    end = 600000000;
+    
+    
+  if (mill->is_vbit() && tool == 0) {
 		double stock_to_leave = 0;
 		while (currentdepth <= -z_offset) {
-          	for (auto i : shapes)
-            	i->create_toolpaths_vcarve(toolnr, currentdepth, stock_to_leave);
+			parallel_for(shapes.size(), [&](unsigned int i) {
+				shapes[i]->create_toolpaths_vcarve(toolnr, currentdepth, stock_to_leave);
+			});
 			currentdepth += depthstep;
 			depthstep = mill->get_depth_of_cut();
 			if (want_finishing_pass())
 				stock_to_leave = 0.1;
-        }
-    } else {
-      vprintf("Tool %i goes from %5.2f mm to %5.2f mm\n", toolnr, start, end);
+      }
+  } else {
+    vprintf("Tool %i goes from %5.2f mm to %5.2f mm\n", toolnr, start, end);
 	  bool inbetween = want_inbetween_paths();
-      while (currentdepth < - z_offset - 0.00000001) {
+    while (currentdepth < - z_offset - 0.00000001) {
 	    
 	    	/* we want courser tools to not get within the stepover of the finer tool */
 		    if (tool < (int)toollist.size() -1) {
 				class endmill *nextmill = get_endmill(toollist[tool+1]);
 				start = nextmill->get_stepover();
 			}
-    
+  
 		    /* if tool 0 is a vcarve bit, tool 1 needs to start at radius at depth of cut */
 		    /* and all others need an offset */
 		    if (tool > 0 && mill0->is_vbit()) {
@@ -378,29 +803,114 @@ void scene::create_toolpaths(void)
 		    }
 
 
-        for (auto i : shapes) {
+      /* every shape only touches its own skeleton and tooldepths */
+      parallel_for(shapes.size(), [&](unsigned int i) {
 			double effectivedepth;
 			effectivedepth = currentdepth;
-			printf("shape depth is %5.4f current is %5.4f\n", i->get_depth(), effectivedepth);
-			if (effectivedepth + depthstep < i->get_depth())
-				continue;
-			if (effectivedepth < i->get_depth())
-				effectivedepth = i->get_depth();
+			if (effectivedepth + depthstep < shapes[i]->get_depth())
+				return;
+			if (effectivedepth < shapes[i]->get_depth())
+				effectivedepth = shapes[i]->get_depth();
 				
-			i->create_toolpaths(toolnr, effectivedepth, finish, inbetween, start, end, _want_skeleton_paths);
-		}
-        currentdepth += depthstep;
-        depthstep = mill->get_depth_of_cut();
-        if (finish)
-          finish = -1;
+			shapes[i]->create_toolpaths(toolnr, effectivedepth, finish, inbetween, start, end, _want_skeleton_paths);
+		});
+      currentdepth += depthstep;
+      depthstep = mill->get_depth_of_cut();
+      if (finish)
+        finish = -1;
 		inbetween = false;
-      }
     }
-    
-    tool--;
   }
+}
+
+void scene::create_toolpaths(void)
+{
+  int tool;
+
+  depth = -fabs(depth);
+
+  qprintf("Creating toolpath for depth %5.2f with offset %5.2f\n", depth, z_offset);
+
+  if (want_inlay()) {
+		inlay_plug = clone_scene(NULL, 1, maxX);
+	    inlay_plug->set_depth(depth / 1.25);
+		inlay_plug->create_toolpaths(); 
+  }
+  
+  vprintf("create_toolpaths with depth %5.2f\n", depth);
+
+  /* cutout toolpath first */
+  create_cutout_toolpaths();
+  
+  for (tool = toollist.size() - 1; tool >= 0; tool--)
+    create_tool_toolpaths(tool);
+
   consolidate_toolpaths();
+  wait_for_skeletons();
+  for (auto i : shapes)
+    i->print_recoveries();
 }
+
+/*
+ * Streaming mode: plan the tools in the order write_naked_gcode() writes them,
+ * and hand each one to the writer as soon as it is consolidated. A tool's
+ * toolpaths only depend on the endmills of its neighbours in the toollist, not
+ * on their toolpaths, so the planning order does not change the result.
+ */
+void scene::plan_in_output_order(void)
+{
+  unsigned int j;
+  unsigned int start = 0;
+
+  depth = -fabs(depth);
+
+  qprintf("Creating toolpath for depth %5.2f with offset %5.2f\n", depth, z_offset);
+
+  create_cutout_toolpaths();
+
+  if (tool_is_vcarve(toollist[0]) && toollist.size() > 1)
+    start = 1;
+
+  for (j = start; j < toollist.size(); j++) {
+    create_tool_toolpaths(j);
+    tool_planned(j);
+  }
+  if (start == 1) {
+    create_tool_toolpaths(0);
+    tool_planned(0);
+  }
+  wait_for_skeletons();
+  for (auto i : shapes)
+    i->print_recoveries();
+
+  /* the plug goes into its own file after the main design, so it comes last */
+  if (want_inlay()) {
+		inlay_plug = clone_scene(NULL, 1, maxX);
+	    inlay_plug->set_depth(depth / 1.25);
+		inlay_plug->create_toolpaths(); 
+  }
+}
+
+void scene::tool_planned(int tool)
+{
+  for (auto i : shapes)
+    i->consolidate_toolpaths(_want_inbetween_paths, toollist[tool]);
+
+  std::lock_guard<std::mutex> lock(plan_lock);
+  planned_tools.push_back(toollist[tool]);
+  plan_done.notify_all();
+}
+
+/* blocks until the planner thread has finished <toolnr>; a no-op outside streaming mode */
+void scene::wait_for_tool(int toolnr)
+{
+  std::unique_lock<std::mutex> lock(plan_lock);
+
+  if (!streaming)
+    return;
+  plan_done.wait(lock, [&] { return std::find(planned_tools.begin(), planned_tools.end(), toolnr) != planned_tools.end(); });
+}
+
 void scene::consolidate_toolpaths(void)
 {
   for (auto i : shapes)
@@ -449,6 +959,7 @@ scene::scene(const char *filename)
        _want_inbetween_paths = false;
        _want_skeleton_paths = false;
        shape = NULL;
+       streaming = false;
        filename = strdup(filename);
        parse_svg_file(this, filename);
 }
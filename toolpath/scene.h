@@ -12,6 +12,9 @@
 using namespace std;
 
 #include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 
 #include "tool.h"
@@ -38,6 +41,7 @@ public:
 			stock_to_leave = 0.1;
 			finishing_pass_stepover = -1;
 	    z_offset = 0;
+			streaming = false;
         }
         
         scene(const char *filename);
@@ -65,7 +69,13 @@ public:
         void write_naked_svg(void);
         void write_svg(const char *filename);
         void write_gcode(const char *filename, const char *description);
-        void write_naked_gcode(void);
+        void write_naked_gcode(class gcode_writer *gcode);
+        void write_tool_gcode(const char *filename, int filenr, int toolnr, bool with_cutout);
+        void write_separate_gcode(const char *filename);
+        void write_gcode_streamed(const char *filename, const char *description);
+
+        bool save_plan(const char *planfile);
+        bool load_plan(const char *planfile);
 
         void process_nesting(void);
         void create_toolpaths(void);
@@ -135,6 +145,24 @@ private:
         void consolidate_toolpaths(void);
         void flatten_nesting(void);
 
+        void output_shapes(class gcode_writer *gcode, int toolnr);
+
+        void create_cutout_toolpaths(void);
+        void create_tool_toolpaths(int tool);
+
+        /* streaming mode: planner thread -> writer hand-off */
+        bool streaming;
+        vector<int> planned_tools;
+        std::mutex plan_lock;
+        std::condition_variable plan_done;
+        void plan_in_output_order(void);
+        void tool_planned(int tool);
+        void wait_for_tool(int toolnr);
+
+        /* skeletons get built in the background from process_nesting() on */
+        std::thread skeleton_stage;
+        void start_skeleton_stage(void);
+        void wait_for_skeletons(void);
         
 };
 
@@ -911,6 +911,7 @@ void process_stl_file(class scene *scene, const char *filename, int flip)
 
 	scale_design_Z(scene->get_cutout_depth(), scene->get_z_offset());
 	print_triangle_stats();
+	build_heightmap();
 
 
 	for ( int i = scene->get_tool_count() - 1; i >= 0 ; i-- ) {
@@ -9,6 +9,8 @@
 #define __INCLUDE_GUARD_TOOL_H_
 
 #include <vector>
+#include <map>
+#include <mutex>
 #include <boost/shared_ptr.hpp>
 #include <CGAL/Exact_predicates_inexact_constructions_kernel.h>
 #include <CGAL/Exact_predicates_exact_constructions_kernel.h>
@@ -37,8 +39,13 @@ typedef boost::shared_ptr<PolygonWithHoles> PolygonWithHolesPtr ;
 typedef std::vector<PolygonWithHolesPtr> PolygonWithHolesPtrVector;
 typedef CGAL::Polygon_with_holes_2<K> Polygon_with_holes ;
 
+/* for the shapes the default kernel gets wrong, see offset_extractor::create() */
+typedef CGAL::Exact_predicates_exact_constructions_kernel KE ;
+
 class inputshape;
 typedef class inputshape inputshape;
+class gcode_writer;
+class offset_extractor;
 
 class toolpath {
 public:
@@ -81,11 +88,11 @@ public:
     void add_polygon(Polygon_2 *poly);
     bool fits_inside(class toolpath *shape);
     double distance_from(double X, double Y);
-	int output_gcode_vcarve_would_retract(void);
+	int output_gcode_vcarve_would_retract(class gcode_writer *gcode);
 
 
     void print_as_svg(const char *color);
-    void output_gcode(void);
+    void output_gcode(class gcode_writer *gcode);
     void recalculate();
     double get_minY(void);
 
@@ -93,9 +100,9 @@ public:
 	const char *color;
 	double priority;
 private:
-    void output_gcode_slotting(void);
-    void output_gcode_reverse(void);
-    void output_gcode_vcarve(void);
+    void output_gcode_slotting(class gcode_writer *gcode);
+    void output_gcode_reverse(class gcode_writer *gcode);
+    void output_gcode_vcarve(class gcode_writer *gcode);
 };
 
 class toollevel {
@@ -150,7 +157,7 @@ public:
 	bool no_sort;
     
     void print_as_svg(void);
-    void output_gcode(void);
+    void output_gcode(class gcode_writer *gcode);
     
     void sort_if_slotting(void);
 };
@@ -182,17 +189,34 @@ public:
     bool run_reverse;
     
     void print_as_svg(void);
-    void output_gcode(void);
+    void output_gcode(class gcode_writer *gcode);
     
     void sort_if_slotting(void);
 };
 
+/* the result of offsetting a shape's skeleton at one inset */
+struct inset_offsets {
+    double inset;	/* as used, after nudging past CGAL exceptions */
+    PolygonWithHolesPtrVector polygons;
+    bool failed;	/* no polygons because offsetting failed, not because nothing is left */
+};
+
+/* how often offsetting a shape needed help, see inputshape::print_recoveries() */
+struct offset_recoveries {
+    unsigned int snapped;	/* input vertices dropped before building the skeleton */
+    unsigned int nudged;	/* insets moved off a skeleton event */
+    unsigned int retries;	/* CGAL threw anyway and the inset got moved again */
+    unsigned int failed;	/* insets given up on */
+    unsigned int exact;		/* redone in the exact kernel */
+};
+
 class inputshape {
 public:
     inputshape() {
         level = 0;
         polyhole = NULL;
-        iss = NULL;
+        extractor = NULL;
+        recoveries = {0, 0, 0, 0, 0};
         name = "unknown";
         minY = 0;
 		is_cutout = false;
@@ -210,16 +234,21 @@ public:
 
     void fix_orientation(void);
     void print_as_svg(void);
-    void output_gcode(int tool);
+    void output_gcode(class gcode_writer *gcode, int tool);
+    bool has_work(int tool);
     
     bool fits_inside(class inputshape *shape);
 
+    bool is_null_shape(void);
+    void build_skeleton(void);
+    void print_recoveries(void);
+
 
     void create_toolpaths(int toolnr, double depth, int finish_pass, int is_optional, double start_inset, double end_inset, bool _want_skeleton_path);
     void create_toolpaths_vcarve(int toolnr, double maxdepth, double stock_to_leave);
     void create_toolpaths_cutout(int toolnr, double depth, bool finish_pass);
     void create_toolpaths_inlayplug(int toolnr, double maxdepth);
-    void consolidate_toolpaths(bool _want_inbetween_paths);
+    void consolidate_toolpaths(bool _want_inbetween_paths, int toolnr = 0);
 
 	void set_z_offset(double d) { z_offset = d; };
 	double get_z_offset(void) { return z_offset; };
@@ -238,6 +267,7 @@ public:
     vector<class inputshape*> children;
     
     void set_name(const char *n);
+    const char *get_name(void) { return name; };
     void set_minY(double mY);
 	double get_minY(void) { return minY;};
     double distance_from_edge(double X, double Y, bool exclude_zero);
@@ -252,13 +282,24 @@ public:
 
     Polygon_2 poly;    
     vector<class tooldepth*> tooldepths;
+    vector<class tooldepth*> get_tooldepths(void);
+    void add_tooldepth(class tooldepth *td, int toolnr);
 
 private:
     const char *name;
 
     PolygonWithHoles *polyhole;
     vector<SsPtr>	skeleton;
-    SsPtr iss;
+    std::once_flag skeleton_once;
+
+    /* every depth pass offsets the skeleton at the same insets again */
+    class offset_extractor *extractor;
+    struct offset_recoveries recoveries;
+    bool use_exact_kernel(void);
+    PolygonWithHolesPtrVector offset_robust(int toolnr, double *inset, bool *failed);
+    map<long long, struct inset_offsets> offset_cache;	/* by inset_key() of the requested inset */
+    PolygonWithHolesPtrVector offsets_at(int toolnr, double *inset, bool *failed);
+    void prefetch_offsets(double inset, int step, double stepover, int want_optional, double end_inset);
     
     
     double bbX1, bbY1, bbX2, bbY2;
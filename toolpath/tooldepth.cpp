@@ -9,6 +9,7 @@
 extern "C" {
     #include "toolpath.h"
 }
+#include "gcode.h"
 
 void tooldepth::print_as_svg(void)
 {
@@ -18,15 +19,15 @@ void tooldepth::print_as_svg(void)
 }
 
 
-void tooldepth::output_gcode(void)
+void tooldepth::output_gcode(class gcode_writer *gcode)
 {
     if (!run_reverse) {
       for (auto i =  toollevels.rbegin(); i != toollevels.rend(); ++i) {
-        (*i)->output_gcode();
+        (*i)->output_gcode(gcode);
       }
     } else {
       for (auto i =  toollevels.begin(); i != toollevels.end(); ++i) {
-        (*i)->output_gcode();
+        (*i)->output_gcode(gcode);
       }
     }
 
@@ -5,10 +5,14 @@
  *
  * SPDX-License-Identifier: GPL-3.0
  */
+#include <time.h>
+
 #include "tool.h"
 extern "C" {
     #include "toolpath.h"
 }
+#include "gcode.h"
+#include "kdtree.h"
 
 static inline double dist(double X0, double Y0, double X1, double Y1)
 {
@@ -27,22 +31,122 @@ void toollevel::print_as_svg(void)
 }
 
 
-static double sortX, sortY;
-static bool compare_path(class toolpath *A, class toolpath *B)
+/*
+ * Picking the next toolpath to cut, as seen from the current tool position:
+ * paths more than NEAR_DISTANCE away get cut highest (shallowest) first,
+ * where depths within DEPTH_BAND of each other count as the same; within
+ * that the lowest priority goes first, and then the nearest path.
+ *
+ * A k-d tree over the points distance_from() looks at keeps this cheap for
+ * levels with many thousands of (vcarve) paths.
+ */
+#define NEAR_DISTANCE 0.1
+#define DEPTH_BAND 0.1
+
+static double two_opt_msec = 0;
+
+void toollevel_set_two_opt_time(double msec)
+{
+	two_opt_msec = msec;
+}
+
+/* the same points toolpath::distance_from() measures to */
+static void path_points(class toolpath *tp, int item, vector<struct kd_point> &points)
+{
+	if (tp->is_slotting || tp->is_single || tp->is_vcarve) {
+		for (auto poly : tp->polygons)
+			for (auto vi = poly->vertices_begin() ; vi != poly->vertices_end() ; ++ vi)
+				points.push_back({CGAL::to_double(vi->x()), CGAL::to_double(vi->y()), item});
+	} else {
+		for (auto poly : tp->polygons) {
+			auto vi = (*poly)[tp->start_vertex];
+			points.push_back({CGAL::to_double(vi.x()), CGAL::to_double(vi.y()), item});
+		}
+	}
+}
+
+static int pick_next(class kdtree *tree, const vector<double> &prios, vector<char> &near, double X, double Y, double *pX, double *pY)
+{
+	vector<int> near_items;
+	double top, min_depth = INFINITY;
+	int best = -1;
+
+	tree->items_within(X, Y, NEAR_DISTANCE, near_items);
+	for (auto i : near_items)
+		near[i] = 1;
+
+	if (tree->top_depth(near, &top))
+		min_depth = top - DEPTH_BAND;
+
+	for (auto p : prios) {
+		best = tree->nearest(X, Y, p, min_depth, near, NEAR_DISTANCE, NULL, pX, pY);
+		if (best >= 0)
+			break;
+	}
+
+	for (auto i : near_items)
+		near[i] = 0;
+	return best;
+}
+
+/* where the tool ends up after cutting a path it entered at X,Y */
+static void path_exit(class toolpath *tp, double X, double Y, double *eX, double *eY)
+{
+	*eX = X;
+	*eY = Y;
+	if (!(tp->is_slotting || tp->is_single) || tp->polygons.size() != 1 || tp->polygons[0]->size() != 2)
+		return;
+	Polygon_2 *p = tp->polygons[0];
+	if (dist(X, Y, CGAL::to_double((*p)[0].x()), CGAL::to_double((*p)[0].y())) < 0.001) {
+		*eX = CGAL::to_double((*p)[1].x());
+		*eY = CGAL::to_double((*p)[1].y());
+	} else {
+		*eX = CGAL::to_double((*p)[0].x());
+		*eY = CGAL::to_double((*p)[0].y());
+	}
+}
+
+static double msec_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * 2-opt over a run of closed loops that the selection rules treat as
+ * equals, between the fixed point before the run and (if there is one) the
+ * fixed entry of the path after it. Loops are entered and left at the same
+ * point so a stretch of them can be cut in reverse order.
+ */
+static bool two_opt_run(vector<double> &pX, vector<double> &pY, vector<int> &order, int first, int last, bool fixed_end, double deadline)
 {
-	if (A->distance_from(sortX, sortY) > 0.1 && B->distance_from(sortX, sortY) > 0.1) {
-		if (fabs(A->depth - B->depth) > 0.1) {
-			if (A->depth > B->depth)
-				return true;
-			if (A->depth < B->depth)
+	bool improved = true;
+
+	while (improved) {
+		improved = false;
+		for (int i = first; i < last; i++) {
+			if (msec_now() > deadline)
 				return false;
+			for (int j = i + 1; j <= last; j++) {
+				double before, after;
+				int a = order[i - 1], b = order[i], c = order[j];
+
+				before = dist(pX[a], pY[a], pX[b], pY[b]);
+				after = dist(pX[a], pY[a], pX[c], pY[c]);
+				if (j < last || fixed_end) {
+					int d = order[j + 1];
+					before += dist(pX[c], pY[c], pX[d], pY[d]);
+					after += dist(pX[b], pY[b], pX[d], pY[d]);
+				}
+				if (after < before - 0.001) {
+					reverse(order.begin() + i, order.begin() + j + 1);
+					improved = true;
+				}
+			}
 		}
 	}
-	if (A->priority < B->priority)
-		return true;
-	if (A->priority > B->priority)
-		return false;
-    return (A->distance_from(sortX, sortY) < B->distance_from(sortX, sortY));
+	return true;
 }
 
 static class toolpath *clone_tp(class toolpath *tp1)
@@ -400,19 +504,17 @@ void toollevel::trim_intersects(void)
 	}
 }
 
-void toollevel::output_gcode(void)
+void toollevel::output_gcode(class gcode_writer *gcode)
 {
     vector<class toolpath*> worklist;    
 
 	if (no_sort) {
 		if (name)
-		    gcode_write_comment(name);
-	    sortX = gcode_current_X();
-	    sortY = gcode_current_Y() + get_minY();
+		    gcode->write_comment(name);
 		unsigned int i;
 
 		for (i = 0; i < toolpaths.size(); i++)
-			toolpaths[i]->output_gcode();
+			toolpaths[i]->output_gcode(gcode);
 		return;
     }
 
@@ -452,33 +554,131 @@ void toollevel::output_gcode(void)
     }
 #endif
 	if (name)
-	    gcode_write_comment(name);
-    sortX = gcode_current_X();
-    sortY = gcode_current_Y() + get_minY();
+	    gcode->write_comment(name);
         
-	if (!no_sort)
-	    sort(worklist.begin(), worklist.end(), compare_path);
-    
-    while (worklist.size() > 0) {
-		bool zero_retracts;
+	vector<struct kd_point> points;
+	vector<double> depths, prios, prio_list;
+	vector<char> near;
+	vector<int> pointless;
+	bool has_vcarve = false;
+
+	for (unsigned int i = 0; i < worklist.size(); i++) {
+		unsigned int before = points.size();
+		path_points(worklist[i], i, points);
+		if (points.size() == before)
+			pointless.push_back(i);
+		depths.push_back(worklist[i]->depth);
+		prios.push_back(worklist[i]->priority);
+		has_vcarve |= worklist[i]->is_vcarve;
+	}
+	prio_list = prios;
+	sort(prio_list.begin(), prio_list.end());
+	prio_list.erase(unique(prio_list.begin(), prio_list.end()), prio_list.end());
+	near.assign(worklist.size(), 0);
+
+	class kdtree tree(points, depths, prios);
+	int remaining = worklist.size() - pointless.size();
+
+	/*
+	 * Plan the whole level up front and shorten the travel with 2-opt. Not for
+	 * vcarving, where the order is decided on the fly to avoid retracts.
+	 */
+	if (two_opt_msec > 0 && !has_vcarve && remaining > 3) {
+		vector<double> pX(worklist.size() + 1), pY(worklist.size() + 1);
+		vector<int> order;
+		double X = gcode->current_X(), Y = gcode->current_Y() + get_minY();
+		double deadline = msec_now() + two_opt_msec;
+		int start = worklist.size();
+
+		/* slot <start> holds where the tool is now */
+		pX[start] = X;
+		pY[start] = Y;
+		order.push_back(start);
+		while (remaining > 0) {
+			double eX, eY, nX, nY;
+			int i = pick_next(&tree, prio_list, near, X, Y, &nX, &nY);
+			if (i < 0)
+				break;
+			pX[i] = nX;
+			pY[i] = nY;
+			path_exit(worklist[i], pX[i], pY[i], &eX, &eY);
+			X = eX;
+			Y = eY;
+			tree.remove(i);
+			order.push_back(i);
+			remaining--;
+		}
 
-		zero_retracts = worklist[0]->output_gcode_vcarve_would_retract();
-		if (!no_sort && worklist.size() > 1 && zero_retracts && !worklist[1]->output_gcode_vcarve_would_retract()) {
-			worklist[1]->output_gcode();
-	        worklist.erase(worklist.begin() + 1);
-		} if (!no_sort && worklist.size() > 2 && zero_retracts && !worklist[2]->output_gcode_vcarve_would_retract()) {
-			worklist[2]->output_gcode();
-	        worklist.erase(worklist.begin() + 2);
+		/* runs of closed loops with the same priority and depth band */
+		for (unsigned int first = 1; first < order.size(); ) {
+			unsigned int last = first;
+			class toolpath *tp = worklist[order[first]];
+			double lo = tp->depth, hi = tp->depth;
+
+			if (!(tp->is_slotting || tp->is_single)) {
+				while (last + 1 < order.size()) {
+					class toolpath *next = worklist[order[last + 1]];
+					if (next->is_slotting || next->is_single || next->priority != tp->priority)
+						break;
+					if (fmax(hi, next->depth) - fmin(lo, next->depth) > DEPTH_BAND)
+						break;
+					lo = fmin(lo, next->depth);
+					hi = fmax(hi, next->depth);
+					last++;
+				}
+			}
+			if (last > first && !two_opt_run(pX, pY, order, first, last, last + 1 < order.size(), deadline)) {
+				vprintf("Out of time for 2-opt in %s\n", name);
+				break;
+			}
+			first = last + 1;
+		}
+
+		for (unsigned int i = 1; i < order.size(); i++)
+			worklist[order[i]]->output_gcode(gcode);
+		for (auto i : pointless)
+			worklist[i]->output_gcode(gcode);
+		return;
+	}
+
+	while (remaining > 0) {
+		int cand[4];
+		int count, i;
+		bool zero_retracts;
+		double X = gcode->current_X(), Y = gcode->current_Y() + get_minY(), pX, pY;
+
+		/* the best four, as the retract lookahead below may skip ahead */
+		for (count = 0; count < 4; count++) {
+			cand[count] = pick_next(&tree, prio_list, near, X, Y, &pX, &pY);
+			if (cand[count] < 0)
+				break;
+			tree.remove(cand[count]);
+		}
+		for (i = 0; i < count; i++)
+			tree.restore(cand[i]);
+		if (count == 0)
+			break;
+
+		zero_retracts = worklist[cand[0]]->output_gcode_vcarve_would_retract(gcode);
+		if (count > 1 && zero_retracts && !worklist[cand[1]]->output_gcode_vcarve_would_retract(gcode)) {
+			worklist[cand[1]]->output_gcode(gcode);
+			tree.remove(cand[1]);
+			remaining--;
+			cand[1] = cand[2];
+			cand[2] = cand[3];
+			count--;
+		} if (count > 2 && zero_retracts && !worklist[cand[2]]->output_gcode_vcarve_would_retract(gcode)) {
+			worklist[cand[2]]->output_gcode(gcode);
+			tree.remove(cand[2]);
+			remaining--;
 		} else {
-			worklist[0]->output_gcode();
-	        worklist.erase(worklist.begin());
+			worklist[cand[0]]->output_gcode(gcode);
+			tree.remove(cand[0]);
+			remaining--;
 		}
-	        sortX = gcode_current_X();
-	        sortY = gcode_current_Y() + get_minY();
-        
-		if (!no_sort)
-    	    sort(worklist.begin(), worklist.end(), compare_path);
-    }
+	}
+	for (auto i : pointless)
+		worklist[i]->output_gcode(gcode);
 }
 
 
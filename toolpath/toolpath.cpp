@@ -7,6 +7,7 @@
  */
 #include "tool.h"
 #include "print.h"
+#include "gcode.h"
 static double dist(double X0, double Y0, double X1, double Y1)
 {
   return sqrt((X1-X0)*(X1-X0) + (Y1-Y0)*(Y1-Y0));
@@ -44,23 +45,23 @@ void toolpath::print_as_svg(const char *_color)
     }
 }
 
-void toolpath::output_gcode(void)
+void toolpath::output_gcode(class gcode_writer *gcode)
 {
   double speed = 1.0;
   double lX = -100000;
   double lY = -100000;
   
   if (is_vcarve) {
-    output_gcode_vcarve();
+    output_gcode_vcarve(gcode);
     return;
   }
   if (is_slotting) {
-    output_gcode_slotting();
+    output_gcode_slotting(gcode);
     return;
   }
   
   if (run_reverse) {
-    output_gcode_reverse();
+    output_gcode_reverse(gcode);
     return;
   }
   bool first = true;
@@ -71,8 +72,8 @@ void toolpath::output_gcode(void)
 	double distance = 500000;
 	double X1, Y1;;
 	
-	cX = gcode_current_X();
-	cY = gcode_current_Y();
+	cX = gcode->current_X();
+	cY = gcode->current_Y();
 	X1 = CGAL::to_double((*poly)[start_vertex].x());
 	Y1 = CGAL::to_double((*poly)[start_vertex].y());
 	distance = dist(X1,Y1,cX,cY);
@@ -98,10 +99,10 @@ void toolpath::output_gcode(void)
       auto vi2 = (*poly)[next];
       
       if (i == 0 && dist(lX,lY, CGAL::to_double(vi.x()), CGAL::to_double(vi.y())) < diameter * 0.75) {
-        gcode_mill_to(CGAL::to_double(vi.x()), CGAL::to_double(vi.y()) - get_minY(), depth, speed * 0.5);
+        gcode->mill_to(CGAL::to_double(vi.x()), CGAL::to_double(vi.y()) - get_minY(), depth, speed * 0.5);
       }
-      gcode_conditional_travel_to(CGAL::to_double(vi.x()), CGAL::to_double(vi.y()) - get_minY(), depth, speed);
-      gcode_mill_to(CGAL::to_double(vi2.x()), CGAL::to_double(vi2.y()) - get_minY(), depth, speed);
+      gcode->conditional_travel_to(CGAL::to_double(vi.x()), CGAL::to_double(vi.y()) - get_minY(), depth, speed);
+      gcode->mill_to(CGAL::to_double(vi2.x()), CGAL::to_double(vi2.y()) - get_minY(), depth, speed);
       lX = CGAL::to_double(vi2.x());
       lY = CGAL::to_double(vi2.y());
     }
@@ -110,56 +111,56 @@ void toolpath::output_gcode(void)
 }
 
 
-void toolpath::output_gcode_vcarve(void)
+void toolpath::output_gcode_vcarve(class gcode_writer *gcode)
 {
   double speed = 1.0;
     
   for (auto poly : polygons) {
     double d0, d1;
-    d0 = dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY());
-    d1 = dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY());
-//    printf("current X %5.4f   current Y %5.4f  \n", gcode_current_X(), gcode_current_Y());
+    d0 = dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY());
+    d1 = dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY());
+//    printf("current X %5.4f   current Y %5.4f  \n", gcode->current_X(), gcode->current_Y());
 //    printf("poly[0]   %5.4f,            %5.4f  \n", (*poly)[0].x(), (*poly)[0].y());
 //    printf("poly[1]   %5.4f,            %5.4f  \n", (*poly)[1].x(), (*poly)[1].y());
 //    printf("get_minY  %5.9f\n", get_minY());
-    if (gcode_has_current() && dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY()) < 0.001) {
-      gcode_vconditional_travel_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
-      gcode_vmill_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed);
+    if (gcode->has_current() && dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY()) < 0.001) {
+      gcode->vconditional_travel_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
+      gcode->vmill_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed);
       continue;
     }
-    if (gcode_has_current() && dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY()) < 0.001) {
-      gcode_vconditional_travel_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
-      gcode_vmill_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
+    if (gcode->has_current() && dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY()) < 0.001) {
+      gcode->vconditional_travel_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
+      gcode->vmill_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
       continue;
     }
     if (depth > depth2) {
-      gcode_vconditional_travel_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
-      gcode_vmill_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed);
+      gcode->vconditional_travel_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
+      gcode->vmill_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed);
       continue;
     }
-    if (gcode_has_current() && d0 > d1) {
-      gcode_vconditional_travel_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
-      gcode_vmill_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
+    if (gcode->has_current() && d0 > d1) {
+      gcode->vconditional_travel_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
+      gcode->vmill_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
       continue;
     }    
 
 #if 0
     if (depth < depth2) {
-      gcode_vconditional_travel_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
-      gcode_vmill_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
+      gcode->vconditional_travel_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
+      gcode->vmill_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
       continue;
     }
 #endif
   
     
 //    printf("fallback\n");
-    gcode_vconditional_travel_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
-    gcode_vmill_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed);
+    gcode->vconditional_travel_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
+    gcode->vmill_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed);
     speed = 1.0;
   }
 }
 
-int toolpath::output_gcode_vcarve_would_retract(void)
+int toolpath::output_gcode_vcarve_would_retract(class gcode_writer *gcode)
 {
   double speed = 1.0;
 
@@ -168,28 +169,28 @@ int toolpath::output_gcode_vcarve_would_retract(void)
     
   for (auto poly : polygons) {
     double d0, d1;
-    d0 = dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY());
-    d1 = dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY());
+    d0 = dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY());
+    d1 = dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY());
 
-    if (dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY()) < 0.001) {
-      return gcode_vconditional_would_retract(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
+    if (dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY()) < 0.001) {
+      return gcode->vconditional_would_retract(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
     }
-    if (dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY()) < 0.001) {
-      return gcode_vconditional_would_retract(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
+    if (dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY()) < 0.001) {
+      return gcode->vconditional_would_retract(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
     }
     if (depth > depth2) {
-      return gcode_vconditional_would_retract(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
+      return gcode->vconditional_would_retract(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
     }
     
     if (d0 > d1) {
-      return gcode_vconditional_would_retract(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
+      return gcode->vconditional_would_retract(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2, speed, CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth);
     }    
-    return gcode_vconditional_would_retract(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
+    return gcode->vconditional_would_retract(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed, CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth2);
   }
   return 0;
 }
 
-void toolpath::output_gcode_reverse(void)
+void toolpath::output_gcode_reverse(class gcode_writer *gcode)
 {
   double speed = 1.0;
   double lX = -100000;
@@ -211,10 +212,10 @@ void toolpath::output_gcode_reverse(void)
       auto vi2 = (*poly)[next];
       
       if (i == 0 && dist(lX,lY, CGAL::to_double(vi.x()), CGAL::to_double(vi.y())) < diameter * 0.75) {
-        gcode_mill_to(CGAL::to_double(vi.x()), CGAL::to_double(vi.y()) - get_minY(), depth, speed * 0.5);
+        gcode->mill_to(CGAL::to_double(vi.x()), CGAL::to_double(vi.y()) - get_minY(), depth, speed * 0.5);
       }
-      gcode_conditional_travel_to(CGAL::to_double(vi.x()), CGAL::to_double(vi.y()) - get_minY(), depth, speed);
-      gcode_mill_to(CGAL::to_double(vi2.x()), CGAL::to_double(vi2.y()) - get_minY(), depth, speed);
+      gcode->conditional_travel_to(CGAL::to_double(vi.x()), CGAL::to_double(vi.y()) - get_minY(), depth, speed);
+      gcode->mill_to(CGAL::to_double(vi2.x()), CGAL::to_double(vi2.y()) - get_minY(), depth, speed);
       lX = CGAL::to_double(vi2.x());
       lY = CGAL::to_double(vi2.y());
     }
@@ -222,22 +223,22 @@ void toolpath::output_gcode_reverse(void)
   }
 }
 
-void toolpath::output_gcode_slotting(void)
+void toolpath::output_gcode_slotting(class gcode_writer *gcode)
 {
   double speed = 1.0;;
     
   for (auto poly : polygons) {
     if (poly->size() == 2) {
       double distance1, distance2;
-      distance1 = dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY());
-      distance2 = dist(gcode_current_X(), gcode_current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY());
+      distance1 = dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY());
+      distance2 = dist(gcode->current_X(), gcode->current_Y(), CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY());
       
       if (distance1 < distance2) {
-         gcode_conditional_travel_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
-         gcode_mill_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth, speed);
+         gcode->conditional_travel_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
+         gcode->mill_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth, speed);
       } else {
-         gcode_conditional_travel_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth, speed);
-         gcode_mill_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
+         gcode->conditional_travel_to(CGAL::to_double((*poly)[1].x()), CGAL::to_double((*poly)[1].y()) - get_minY(), depth, speed);
+         gcode->mill_to(CGAL::to_double((*poly)[0].x()), CGAL::to_double((*poly)[0].y()) - get_minY(), depth, speed);
       }
       return;
     }
@@ -246,8 +247,8 @@ void toolpath::output_gcode_slotting(void)
       if (vi2 == poly->vertices_end())
         vi2 = poly->vertices_begin();
         
-      gcode_conditional_travel_to(CGAL::to_double(vi->x()), CGAL::to_double(vi->y()) - get_minY(), depth, speed);
-      gcode_mill_to(CGAL::to_double(vi2->x()), CGAL::to_double(vi2->y()) - get_minY(), depth, speed);
+      gcode->conditional_travel_to(CGAL::to_double(vi->x()), CGAL::to_double(vi->y()) - get_minY(), depth, speed);
+      gcode->mill_to(CGAL::to_double(vi2->x()), CGAL::to_double(vi2->y()) - get_minY(), depth, speed);
     }
   }
 }
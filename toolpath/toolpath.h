@@ -48,18 +48,6 @@ extern void set_retract_height_imperial(double _rh_inch);
 extern void set_retract_height_metric(double _rh_mm);
 extern double get_retract_height_metric(void);
 extern void set_rippem(double _rippem);
-extern void write_gcode_header(const char *filename);
-extern void write_gcode_footer(void);
-extern void gcode_mill_to(double X, double Y, double Z, double speedratio);
-extern void gcode_vmill_to(double X, double Y, double Z, double speedratio);
-extern void gcode_plunge_to(double Z, double speedratio);
-extern void gcode_retract(void);
-extern void gcode_travel_to(double X, double Y);
-extern void gcode_conditional_travel_to(double X, double Y, double Z, double speed);
-extern void gcode_vconditional_travel_to(double X, double Y, double Z, double speed, double nextX, double nextY, double nextZ);
-extern void gcode_write_comment(const char *comment);
-extern double gcode_current_X(void);
-extern double gcode_current_Y(void);
 extern void read_tool_lib(const char *filename);
 extern int have_tool(int nr);
 extern int next_tool(int nr);
@@ -68,22 +56,32 @@ extern const char * get_tool_name(int nr);
 extern void activate_tool(int nr);
 extern void print_tools(void);
 extern const char * tool_svgcolor(int toolnr);
-extern void gcode_tool_change(int toolnr);
 extern double get_tool_angle(int toolnr);
 extern int tool_is_vcarve(int toolnr);
 extern int tool_is_ballnose(int toolnr);
-extern int gcode_vconditional_would_retract(double X, double Y, double Z, double speed, double nextX, double nextY, double nextZ);
 extern double distance_point_from_vector(double X1, double Y1, double X2, double Y2, double pX, double pY);
 double distance_point_from_vector_ll(double X1, double Y1, double X2, double Y2, double pX, double pY, double *LL);
 extern int lines_tangent_to_two_circles(double X1, double Y1, double R1, double X2, double Y2, double R2, int select, double *pX1, double *pY1, double *pX2, double *pY2);
 extern int vector_intersects_vector(double X1, double Y1, double X2, double Y2, double X3, double Y3, double X4, double Y4, double *pX, double *pY);
 extern int vector_intersects_vector_l(double X1, double Y1, double X2, double Y2, double X3, double Y3, double X4, double Y4, double *out_l);
 extern void vector_apply_l(double *X1, double *Y1, double *X2, double *Y2, double l1,double l2);
-extern int gcode_has_current(void);
-extern void gcode_reset_current(void);
 extern void gcode_set_roughing(int value);
 extern void gcode_want_separate_files(void);
 extern void gcode_want_adaptive(void);
+extern int gcode_separate_files(void);
+extern int gcode_is_adaptive(void);
+extern void gcode_set_arc_tolerance(double tolerance_mm);
+extern void gcode_set_merge_tolerance(double tolerance_mm);
+extern void gcode_stream_to_stdout(void);
+extern int gcode_set_dialect(const char *name);
+extern void gcode_want_line_numbers(void);
+extern void gcode_want_staydown(void);
+extern void gcode_set_low_rapids(double margin_mm);
+extern void gcode_want_estimate(double accel, double junction_deviation, double rapid);
+extern double gcode_get_rapid_rate(void);
+extern int scene_set_pocket_order(const char *name);
+extern void set_parallel_jobs(int jobs);
+extern void toollevel_set_two_opt_time(double msec);
 
 static inline double px_to_inch(double px) { return px / 96.0; };
 static inline double px_to_mm(double px) { return 25.4 * px / 96.0; };
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <math.h>
 
 #include "fenrus.h"
@@ -34,6 +35,25 @@ static float maxY = -100000;
 static float minZ = 100000;
 static float maxZ = -100000;
 
+/*
+ * Optional quantized heightmap. Heights are bounded by the (scaled) model height,
+ * so 16 bits over that range is plenty and halves the memory of a float grid.
+ * Each grid point holds ceil(Z / hm_step) of the model there, and a lookup
+ * interpolates bilinearly between the four around it. That is exact on any
+ * face that spans a whole cell, but can cut off a ridge or peak narrower than
+ * a cell; so each cell also holds how far the model rises above that
+ * interpolation anywhere over it, and the lookup adds it back. That way we
+ * never report a height below the model.
+ */
+typedef uint16_t v4hu __attribute__((vector_size(8)));
+typedef float v4sf __attribute__((vector_size(16)));
+
+static double hm_resolution = 0;
+static double hm_step;
+static uint16_t *heightmap;
+static uint16_t *hm_excess;		/* per cell, in hm_step too */
+static int hm_width, hm_height;
+
 
 static double dist(double X0, double Y0, double X1, double Y1)
 {
@@ -44,6 +64,10 @@ void reset_triangles(void)
 {
 	free(triangles);
 	triangles = NULL;
+	free(heightmap);
+	heightmap = NULL;
+	free(hm_excess);
+	hm_excess = NULL;
 	current = 0;
 	maxtriangle = 0;
 	minX = 100000;
@@ -506,11 +530,185 @@ double get_height_old(double X, double Y)
 	return value;
 }
 
+/* does the cell X0,Y0 - X1,Y1 share any point with triangle <t>? */
+static int cell_touches_triangle(double X0, double Y0, double X1, double Y1, int t)
+{
+	int e;
+
+	/* the bounding boxes overlap already; look for a triangle edge that separates them */
+	for (e = 0; e < 3; e++) {
+		float *A = triangles[t].vertex[e], *B = triangles[t].vertex[(e + 1) % 3], *C = triangles[t].vertex[(e + 2) % 3];
+		double inside = point_to_the_left(C[0], C[1], A[0], A[1], B[0], B[1]);
+
+		if (point_to_the_left(X0, Y0, A[0], A[1], B[0], B[1]) * inside < 0 &&
+		    point_to_the_left(X1, Y0, A[0], A[1], B[0], B[1]) * inside < 0 &&
+		    point_to_the_left(X0, Y1, A[0], A[1], B[0], B[1]) * inside < 0 &&
+		    point_to_the_left(X1, Y1, A[0], A[1], B[0], B[1]) * inside < 0)
+			return 0;
+	}
+	return 1;
+}
+
+void set_heightmap_resolution(double resolution)
+{
+	hm_resolution = resolution;
+}
+
+/* grid index range of the bounding box of triangle <t>, clipped to the map */
+static void heightmap_span(int t, int *i0, int *i1, int *j0, int *j1)
+{
+	*i0 = (int)floor(triangles[t].minX / hm_resolution);
+	*i1 = (int)floor(triangles[t].maxX / hm_resolution);
+	*j0 = (int)floor(triangles[t].minY / hm_resolution);
+	*j1 = (int)floor(triangles[t].maxY / hm_resolution);
+	if (*i0 < 0)
+		*i0 = 0;
+	if (*j0 < 0)
+		*j0 = 0;
+	if (*i1 >= hm_width - 1)
+		*i1 = hm_width - 2;
+	if (*j1 >= hm_height - 1)
+		*j1 = hm_height - 2;
+}
+
+void build_heightmap(void)
+{
+	int t;
+	size_t cells;
+
+	if (hm_resolution <= 0 || maxZ <= 0)
+		return;
+
+	free(heightmap);
+	heightmap = NULL;
+	free(hm_excess);
+	hm_excess = NULL;
+
+	hm_width = (int)ceil(maxX / hm_resolution) + 2;
+	hm_height = (int)ceil(maxY / hm_resolution) + 2;
+	hm_step = maxZ / 65535.0;
+	cells = (size_t)hm_width * hm_height;
+
+	heightmap = calloc(cells, sizeof(uint16_t));
+	hm_excess = calloc(cells, sizeof(uint16_t));
+	if (!heightmap || !hm_excess) {
+		printf("Cannot allocate %5.1f MB for the heightmap, using the triangles directly\n", 2 * cells * sizeof(uint16_t) / 1048576.0);
+		free(heightmap);
+		heightmap = NULL;
+		free(hm_excess);
+		hm_excess = NULL;
+		return;
+	}
+	qprintf("Heightmap                     : %i x %i cells at %5.3f mm (%5.1f MB)\n", hm_width, hm_height, hm_resolution, 2 * cells * sizeof(uint16_t) / 1048576.0);
+
+	/* rasterize each triangle into the grid points it covers */
+	for (t = 0; t < current; t++) {
+		int i0, i1, j0, j1, i, j;
+		float det;
+
+		det = (triangles[t].vertex[1][1] - triangles[t].vertex[2][1]) * (triangles[t].vertex[0][0] - triangles[t].vertex[2][0]) +
+		      (triangles[t].vertex[2][0] - triangles[t].vertex[1][0]) * (triangles[t].vertex[0][1] - triangles[t].vertex[2][1]);
+		/* vertical triangles have no area from the top; their neighbours carry the height */
+		if (det == 0)
+			continue;
+
+		heightmap_span(t, &i0, &i1, &j0, &j1);
+		for (j = j0; j <= j1 + 1; j++) {
+			uint16_t *row = heightmap + (size_t)j * hm_width;
+			for (i = i0; i <= i1 + 1; i++) {
+				double Z, q;
+				if (!within_triangle(i * hm_resolution, j * hm_resolution, t))
+					continue;
+				Z = calc_Z(i * hm_resolution, j * hm_resolution, t);
+				if (!(Z > 0))
+					continue;
+				q = fmin(ceil(Z / hm_step), 65535);
+				if (q > row[i])
+					row[i] = (uint16_t)q;
+			}
+		}
+	}
+
+	/*
+	 * Over a cell, a triangle's plane minus the bilinear interpolation is
+	 * bilinear too, so it peaks in one of the cell corners; it also can't
+	 * rise above the triangle's top vertex. Either bounds the excess.
+	 */
+	for (t = 0; t < current; t++) {
+		int i0, i1, j0, j1, i, j;
+		float det, top;
+
+		det = (triangles[t].vertex[1][1] - triangles[t].vertex[2][1]) * (triangles[t].vertex[0][0] - triangles[t].vertex[2][0]) +
+		      (triangles[t].vertex[2][0] - triangles[t].vertex[1][0]) * (triangles[t].vertex[0][1] - triangles[t].vertex[2][1]);
+		if (det == 0)
+			continue;
+
+		top = fmax(triangles[t].vertex[0][2], fmax(triangles[t].vertex[1][2], triangles[t].vertex[2][2]));
+		if (!(top > 0))
+			continue;
+
+		heightmap_span(t, &i0, &i1, &j0, &j1);
+		for (j = j0; j <= j1; j++) {
+			uint16_t *row0 = heightmap + (size_t)j * hm_width, *row1 = row0 + hm_width;
+			uint16_t *ex = hm_excess + (size_t)j * hm_width;
+			double y0 = j * hm_resolution, y1 = (j + 1) * hm_resolution;
+			for (i = i0; i <= i1; i++) {
+				double x0 = i * hm_resolution, x1 = (i + 1) * hm_resolution;
+				double z00 = row0[i] * hm_step, z10 = row0[i + 1] * hm_step, z01 = row1[i] * hm_step, z11 = row1[i + 1] * hm_step;
+				double E, q;
+				if (!cell_touches_triangle(x0, y0, x1, y1, t))
+					continue;
+				E = fmax(fmax(calc_Z(x0, y0, t) - z00, calc_Z(x1, y0, t) - z10), fmax(calc_Z(x0, y1, t) - z01, calc_Z(x1, y1, t) - z11));
+				E = fmin(E, top - fmin(fmin(z00, z10), fmin(z01, z11)));
+				if (!(E > 0))
+					continue;
+				q = fmin(ceil(E / hm_step), 65535);
+				if (q > ex[i])
+					ex[i] = (uint16_t)q;
+			}
+		}
+	}
+}
+
+/* bilinear lookup plus the excess of the cell; the four grid values get dequantized in one vector op */
+static double get_height_heightmap(double X, double Y)
+{
+	double fx, fy;
+	int i, j;
+	uint16_t *row0, *row1;
+	v4hu qi;
+	v4sf q, w;
+
+	fx = X / hm_resolution;
+	fy = Y / hm_resolution;
+	if (fx < 0 || fy < 0)
+		return 0;
+	i = (int)fx;
+	j = (int)fy;
+	if (i >= hm_width - 1 || j >= hm_height - 1)
+		return 0;
+	fx -= i;
+	fy -= j;
+
+	row0 = heightmap + (size_t)j * hm_width + i;
+	row1 = row0 + hm_width;
+
+	qi = (v4hu){row0[0], row0[1], row1[0], row1[1]};
+	q = __builtin_convertvector(qi, v4sf);
+	w = (v4sf){(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+	q = q * w;
+
+	return (q[0] + q[1] + q[2] + q[3] + hm_excess[(size_t)j * hm_width + i]) * hm_step;
+}
+
 double get_height(double X, double Y)
 {
 	double value = 0;
 	int i, b, j, b2;
 
+	if (heightmap)
+		return get_height_heightmap(X, Y);
+
 	if (nrbuckets == 0)
 		make_buckets();
 